@@ -0,0 +1,836 @@
+/*
+    Benchmarks for pda
+
+    Build next to pda.c with `cc -O2 -pthread -o bench bench.c`.
+
+    bench gen <random|log|pathological> <megabytes> <filename>
+        Writes a synthetic corpus, for trying the tool on by hand.
+
+    bench codegen [--size <megabytes>]
+        Generates each corpus and, for every pattern in the matrix that
+        emitMatcher can handle, compiles the C it emits with cc and loads it.
+        Reports the time that took, and the scan throughput of the generated
+        matcher against the lazy DFA and runNFA alone, all without -g.
+
+    bench compressed
+        Checks and times searching gzip and zstd input with the pda binary, as
+        described below.
+
+    bench lines
+        Checks what the pda binary prints in line mode against grep, as described
+        below.
+
+    bench [--size <megabytes>] [--repeat <n>] [--no-grep] [--tsv]
+        Generates each corpus in memory and runs a fixed matrix of patterns over
+        it. For every pair it reports the time to construct and compile the
+        pattern, the scan throughput with the lazy DFA, with the bit-parallel
+        engine and with runNFA alone, the median and 99th percentile time to find
+        a match, and the match count.
+        Unless --no-grep is given, the corpus is also searched with `grep -oE`
+        to compare counts and throughput.
+
+    Matches are searched for in line mode with greedy matching, which is the
+    closest configuration to grep -o. grep reports the leftmost-longest match,
+    whereas pda reports the longest match starting where the earliest-ending
+    match starts. Counts can therefore differ on some patterns, and differing
+    counts are marked with a *.
+*/
+
+#define PDA_NO_MAIN
+#include "pda.c"
+
+#include <time.h>
+#include <dlfcn.h>
+#include <sys/wait.h>
+
+#define BENCH_DEFAULT_MEGABYTES 4
+#define BENCH_DEFAULT_REPEAT 200
+#define PATHOLOGICAL_RUN 10000      // Length of each run of 'a' in the pathological corpus
+
+// --------------------------------------------------------------------------- // 
+// --------------------------------------------------------------------------- // 
+
+/*
+    Corpus generation
+
+    The corpora are generated from a fixed seed, so every run sees the same bytes.
+*/
+
+enum Corpus { CORPUS_RANDOM, CORPUS_LOG, CORPUS_PATHOLOGICAL, NUM_CORPORA };
+
+static const char *corpusNames[NUM_CORPORA] = { "random", "log", "pathological" };
+
+static uint64_t randomNext(uint64_t *state) {
+    // xorshift64*
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+// Lowercase letters and spaces, with lines of up to 120 bytes
+static void generateRandom(char *buffer, size_t size, uint64_t *seed) {
+    size_t lineLength = 0;
+    for (size_t i = 0; i < size; i++) {
+        uint64_t r = randomNext(seed);
+        if (lineLength > 20 && r % 100 == 0) {
+            buffer[i] = '\n';
+            lineLength = 0;
+        } else if (r % 7 == 0) {
+            buffer[i] = ' ';
+            lineLength++;
+        } else {
+            buffer[i] = 'a' + (char)((r >> 8) % 26);
+            lineLength++;
+        }
+    }
+    if (size > 0) {
+        buffer[size - 1] = '\n';
+    }
+}
+
+// Lines like those of a service log, mostly INFO with the odd error
+static void generateLog(char *buffer, size_t size, uint64_t *seed) {
+    static const char *levels[] = { "INFO", "INFO", "INFO", "INFO", "DEBUG", "DEBUG", "WARN", "ERROR" };
+    static const char *messages[] = {
+        "request served", "connection opened", "connection closed", "cache miss", "retrying request",
+        "upstream timeout", "slow query", "session expired"
+    };
+    size_t pos = 0;
+    char line[256];
+    while (pos < size) {
+        uint64_t r = randomNext(seed);
+        int length = snprintf(line, sizeof(line),
+                              "2024-03-%02u %02u:%02u:%02u.%03u %s [worker-%u] %s id=%u took %ums status=%u\n",
+                              (unsigned)(r % 28 + 1), (unsigned)(r >> 5 & 0xf) + 8, (unsigned)(r >> 9) % 60,
+                              (unsigned)(r >> 15) % 60, (unsigned)(r >> 21) % 1000, levels[r >> 31 & 7],
+                              (unsigned)(r >> 34 & 15), messages[r >> 38 & 7], (unsigned)(r >> 41 & 0xfffff),
+                              (unsigned)(r >> 20 & 0x3ff), (r >> 60) == 0 ? 503u : 200u);
+        size_t n = (size_t)length < size - pos ? (size_t)length : size - pos;
+        memcpy(buffer + pos, line, n);
+        pos += n;
+    }
+}
+
+// Long runs of 'a', which drive patterns such as (a+)+b into their worst case
+static void generatePathological(char *buffer, size_t size, uint64_t *seed) {
+    (void)seed;
+    for (size_t i = 0; i < size; i++) {
+        buffer[i] = (i + 1) % (PATHOLOGICAL_RUN + 1) == 0 ? '\n' : 'a';
+    }
+}
+
+static char *generateCorpus(enum Corpus corpus, size_t size) {
+    char *buffer = malloc(size > 0 ? size : 1);
+    uint64_t seed = 0x9E3779B97F4A7C15ULL + (uint64_t)corpus;
+    switch (corpus) {
+        case CORPUS_RANDOM:
+            generateRandom(buffer, size, &seed);
+            break;
+        case CORPUS_LOG:
+            generateLog(buffer, size, &seed);
+            break;
+        default:
+            generatePathological(buffer, size, &seed);
+            break;
+    }
+    return buffer;
+}
+
+// --------------------------------------------------------------------------- // 
+// --------------------------------------------------------------------------- // 
+
+/*
+    Pattern matrix
+
+    Each corpus is searched for a handful of patterns. These range from a plain
+    literal, through wildcards and repetition, to patterns that keep many threads
+    alive or rarely match.
+*/
+
+struct BenchCase {
+    enum Corpus corpus;
+    const char *pattern;
+};
+
+static const struct BenchCase benchCases[] = {
+    { CORPUS_RANDOM, "the" },
+    { CORPUS_RANDOM, "q.u.z" },
+    { CORPUS_RANDOM, "x+y+z" },
+    { CORPUS_RANDOM, "e.*e" },
+    { CORPUS_RANDOM, "[a-f]{5}" },
+    { CORPUS_LOG, "ERROR" },
+    { CORPUS_LOG, "ERROR.*timeout" },
+    { CORPUS_LOG, "status=503" },
+    { CORPUS_LOG, "took 9.*ms" },
+    { CORPUS_LOG, "worker-1(2)?\\]" },
+    { CORPUS_LOG, "id=[0-9]{6}" },
+    { CORPUS_LOG, "ERROR.{0,80}time" },
+    { CORPUS_PATHOLOGICAL, "(a+)+b" },
+    { CORPUS_PATHOLOGICAL, "a*a*a*a*a*b" },
+    { CORPUS_PATHOLOGICAL, "(aa?)+b" },
+    { CORPUS_PATHOLOGICAL, "aaaa" },
+    { CORPUS_PATHOLOGICAL, "a.{0,100}b" },
+};
+
+#define NUM_BENCH_CASES (sizeof(benchCases) / sizeof(benchCases[0]))
+
+// --------------------------------------------------------------------------- // 
+// --------------------------------------------------------------------------- // 
+
+static uint64_t nowNanoseconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int compareTimes(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double megabytesPerSecond(size_t size, uint64_t nanoseconds) {
+    return nanoseconds > 0 ? (double)size / (1 << 20) / ((double)nanoseconds / 1e9) : 0.0;
+}
+
+struct BenchResult {
+    uint64_t compileTime;       // Median over the repetitions
+    uint64_t dfaTime;
+    uint64_t bitTime;           // 0 if the pattern is too large for the bit-parallel engine
+    uint64_t nfaTime;
+    uint64_t matchP50, matchP99;
+    size_t matches;
+    bool ranGrep;
+    uint64_t grepTime;
+    size_t grepMatches;
+};
+
+static struct Program *compilePattern(const char *pattern) {
+    struct NFA nfa = constructNFA(pattern, false);
+    struct Program *prog = compileNFA(&nfa, 1, true);
+    freeNFA(&nfa);
+    return prog;
+}
+
+static uint64_t timeCompile(const char *pattern, int repeat) {
+    uint64_t *times = malloc(repeat * sizeof(uint64_t));
+    for (int i = 0; i < repeat; i++) {
+        uint64_t start = nowNanoseconds();
+        freeProgram(compilePattern(pattern));
+        times[i] = nowNanoseconds() - start;
+    }
+    qsort(times, repeat, sizeof(uint64_t), compareTimes);
+    uint64_t median = times[repeat / 2];
+    free(times);
+    return median;
+}
+
+/*
+    Scans the whole corpus, returning the total time. If matchTimes is given, the
+    time each match took to find is recorded there. The bit-parallel engine is
+    preferred over the DFA when the program has one, so it is hidden unless
+    bitParallel is set.
+*/
+static uint64_t timeScan(struct Program *prog, size_t dfaCacheStates, bool bitParallel, bool greedy,
+                         const char *corpus, size_t size, uint64_t **matchTimes, size_t *numMatches) {
+    struct Glushkov *glushkov = prog->glushkov;
+    if (!bitParallel) {
+        prog->glushkov = NULL;
+    }
+    struct DFA *dfa = dfaCacheStates > 0 ? newDFA(prog, dfaCacheStates) : NULL;
+    struct NFAScratch *scratch = newNFAScratch(prog);
+    size_t maxTimes = 1024;
+    if (matchTimes) {
+        *matchTimes = malloc(maxTimes * sizeof(uint64_t));
+    }
+
+    struct MatchIterator it;
+    initMatchIterator(&it, prog, dfa, scratch, corpus, size, true, greedy);
+    struct Match m;
+    size_t count = 0;
+    uint64_t start = nowNanoseconds();
+    uint64_t last = start;
+    while (nextMatch(&it, &m)) {
+        if (matchTimes) {
+            uint64_t now = nowNanoseconds();
+            if (count == maxTimes) {
+                maxTimes *= 2;
+                *matchTimes = realloc(*matchTimes, maxTimes * sizeof(uint64_t));
+            }
+            (*matchTimes)[count] = now - last;
+            last = now;
+        }
+        count++;
+    }
+    uint64_t total = nowNanoseconds() - start;
+
+    if (dfa) {
+        freeDFA(dfa);
+    }
+    freeNFAScratch(scratch);
+    prog->glushkov = glushkov;
+    *numMatches = count;
+    return total;
+}
+
+// Runs grep -oE over the file, counting the matches it prints. Returns false if
+// grep could not be run.
+static bool timeGrep(const char *pattern, const char *path, uint64_t *time, size_t *numMatches) {
+    // Single-quote the pattern for the shell
+    size_t length = strlen(pattern);
+    char *command = malloc(4 * length + strlen(path) + 64);
+    char *c = command + sprintf(command, "grep -oE -- '");
+    for (const char *p = pattern; *p; p++) {
+        if (*p == '\'') {
+            c += sprintf(c, "'\\''");
+        } else {
+            *c++ = *p;
+        }
+    }
+    sprintf(c, "' '%s'", path);
+
+    uint64_t start = nowNanoseconds();
+    FILE *grep = popen(command, "r");
+    free(command);
+    if (!grep) {
+        return false;
+    }
+    char buffer[1 << 16];
+    size_t n, count = 0;
+    while ((n = fread(buffer, 1, sizeof(buffer), grep)) > 0) {
+        count += countNewlines(buffer, n);
+    }
+    int status = pclose(grep);
+    *time = nowNanoseconds() - start;
+    *numMatches = count;
+    // grep exits with 1 when nothing matched
+    return status != -1 && WIFEXITED(status) && WEXITSTATUS(status) <= 1;
+}
+
+static struct BenchResult runCase(const struct BenchCase *bc, const char *corpus, size_t size, const char *path,
+                                  int repeat) {
+    struct BenchResult result = {0};
+    result.compileTime = timeCompile(bc->pattern, repeat);
+
+    struct Program *prog = compilePattern(bc->pattern);
+    uint64_t *matchTimes = NULL;
+    size_t nfaMatches, bitMatches;
+    result.dfaTime = timeScan(prog, DFA_DEFAULT_CACHE_STATES, false, true, corpus, size, &matchTimes,
+                              &result.matches);
+    if (prog->glushkov) {
+        result.bitTime = timeScan(prog, 0, true, true, corpus, size, NULL, &bitMatches);
+        assert(bitMatches == result.matches);
+    }
+    result.nfaTime = timeScan(prog, 0, false, true, corpus, size, NULL, &nfaMatches);
+    assert(nfaMatches == result.matches);
+    freeProgram(prog);
+
+    if (result.matches > 0) {
+        qsort(matchTimes, result.matches, sizeof(uint64_t), compareTimes);
+        result.matchP50 = matchTimes[result.matches / 2];
+        result.matchP99 = matchTimes[result.matches * 99 / 100];
+    }
+    free(matchTimes);
+
+    if (path) {
+        result.ranGrep = timeGrep(bc->pattern, path, &result.grepTime, &result.grepMatches);
+    }
+    return result;
+}
+
+// --------------------------------------------------------------------------- // 
+// --------------------------------------------------------------------------- // 
+
+/*
+    Generated matchers
+
+    bench codegen writes each pattern out as C with emitMatcher, builds it into a
+    shared object with the system compiler (cc, or $CC) and loads it, then scans
+    the corpus with it, with the lazy DFA and with runNFA alone. All three search
+    without -g, since that is all the generated code does.
+*/
+
+#define BENCH_MATCHER_NAME "bench_matcher"
+
+struct GeneratedMatcher {
+    void *handle;
+    int (*search)(const char *input, size_t length, size_t *start, size_t *matchLength);
+};
+
+// Emits, compiles and loads a matcher for the program. Returns false if it could
+// not be generated or built.
+static bool loadGenerated(const struct Program *prog, const char *pattern, struct GeneratedMatcher *matcher) {
+    char source[] = "/tmp/pda-bench-XXXXXX.c";
+    int fd = mkstemps(source, 2);
+    if (fd < 0) {
+        return false;
+    }
+    FILE *file = fdopen(fd, "w");
+    char *patterns[] = { (char *)pattern };
+    const char *error;
+    bool ok = emitMatcher(file, prog, patterns, BENCH_MATCHER_NAME, &error);
+    ok = fclose(file) == 0 && ok;
+
+    char object[sizeof(source) + 1];
+    strcpy(object, source);
+    strcpy(object + sizeof(source) - 2, "so");
+    const char *compiler = getenv("CC") ? getenv("CC") : "cc";
+    char command[256];
+    snprintf(command, sizeof(command), "%s -O2 -shared -fPIC -o '%s' '%s'", compiler, object, source);
+    ok = ok && system(command) == 0;
+    unlink(source);
+
+    matcher->handle = ok ? dlopen(object, RTLD_NOW | RTLD_LOCAL) : NULL;
+    unlink(object);
+    if (!matcher->handle) {
+        return false;
+    }
+    matcher->search = (int (*)(const char *, size_t, size_t *, size_t *))dlsym(matcher->handle,
+                                                                               BENCH_MATCHER_NAME "_search");
+    if (!matcher->search) {
+        dlclose(matcher->handle);
+        return false;
+    }
+    return true;
+}
+
+// Scans the whole corpus with a generated matcher, as nextMatch does
+static uint64_t timeGenerated(const struct GeneratedMatcher *matcher, const char *corpus, size_t size,
+                              size_t *numMatches) {
+    size_t count = 0, offset = 0, start, length;
+    uint64_t begin = nowNanoseconds();
+    while (offset < size && matcher->search(corpus + offset, size - offset, &start, &length) >= 0) {
+        offset += start + length;
+        count++;
+    }
+    *numMatches = count;
+    return nowNanoseconds() - begin;
+}
+
+// --------------------------------------------------------------------------- // 
+// --------------------------------------------------------------------------- // 
+
+static void printUsage(char *prog) {
+    fprintf(stderr, "Usage: %s [--size <megabytes>] [--repeat <n>] [--no-grep] [--tsv]\n", prog);
+    fprintf(stderr, "       %s gen <random|log|pathological> <megabytes> <filename>\n", prog);
+    fprintf(stderr, "       %s codegen [--size <megabytes>]\n", prog);
+    fprintf(stderr, "       %s compressed\n", prog);
+    fprintf(stderr, "       %s lines\n", prog);
+    fprintf(stderr, "  --size: Size of each generated corpus (default %d)\n", BENCH_DEFAULT_MEGABYTES);
+    fprintf(stderr, "  --repeat: Times each pattern is compiled, for the median (default %d)\n",
+            BENCH_DEFAULT_REPEAT);
+    fprintf(stderr, "  --no-grep: Do not compare against grep -oE\n");
+    fprintf(stderr, "  --tsv: Print tab-separated values, times in nanoseconds\n");
+}
+
+static bool parseCorpus(const char *name, enum Corpus *corpus) {
+    for (int c = 0; c < NUM_CORPORA; c++) {
+        if (strcmp(name, corpusNames[c]) == 0) {
+            *corpus = (enum Corpus)c;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool writeFile(const char *path, const char *buffer, size_t size) {
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        return false;
+    }
+    bool ok = fwrite(buffer, 1, size, file) == size;
+    return fclose(file) == 0 && ok;
+}
+
+static int generateCommand(int argc, char *argv[]) {
+    enum Corpus corpus;
+    char *end;
+    size_t megabytes = argc == 5 ? strtoul(argv[3], &end, 10) : 0;
+    if (argc != 5 || !parseCorpus(argv[2], &corpus) || *end) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    size_t size = megabytes << 20;
+    char *buffer = generateCorpus(corpus, size);
+    bool ok = writeFile(argv[4], buffer, size);
+    free(buffer);
+    if (!ok) {
+        fprintf(stderr, "Error: Could not write file '%s'\n", argv[4]);
+        return 1;
+    }
+    return 0;
+}
+
+static int codegenCommand(int argc, char *argv[]) {
+    size_t megabytes = BENCH_DEFAULT_MEGABYTES;
+    char *end = "";
+    if (argc == 4 && strcmp(argv[2], "--size") == 0) {
+        megabytes = strtoul(argv[3], &end, 10);
+    } else if (argc != 2) {
+        end = "x";
+    }
+    if (*end || megabytes == 0) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    size_t size = megabytes << 20;
+
+    printf("%-13s %-16s %10s %10s %10s %10s %8s %9s\n", "corpus", "pattern", "build", "gen MB/s", "dfa MB/s",
+           "nfa MB/s", "vs nfa", "matches");
+    for (int c = 0; c < NUM_CORPORA; c++) {
+        char *corpus = generateCorpus((enum Corpus)c, size);
+        for (size_t i = 0; i < NUM_BENCH_CASES; i++) {
+            const struct BenchCase *bc = &benchCases[i];
+            if ((int)bc->corpus != c) {
+                continue;
+            }
+            printf("%-13s %-16s", corpusNames[c], bc->pattern);
+            fflush(stdout);
+
+            struct Program *prog = compilePattern(bc->pattern);
+            struct GeneratedMatcher matcher;
+            uint64_t buildStart = nowNanoseconds();
+            if (!loadGenerated(prog, bc->pattern, &matcher)) {
+                printf(" %10s\n", "-");
+                freeProgram(prog);
+                continue;
+            }
+            uint64_t buildTime = nowNanoseconds() - buildStart;
+
+            size_t matches, dfaMatches, nfaMatches;
+            uint64_t generatedTime = timeGenerated(&matcher, corpus, size, &matches);
+            uint64_t dfaTime = timeScan(prog, DFA_DEFAULT_CACHE_STATES, false, false, corpus, size, NULL,
+                                        &dfaMatches);
+            uint64_t nfaTime = timeScan(prog, 0, false, false, corpus, size, NULL, &nfaMatches);
+            assert(dfaMatches == matches && nfaMatches == matches);
+            dlclose(matcher.handle);
+            freeProgram(prog);
+
+            printf(" %8.1fms %10.1f %10.1f %10.1f %7.1fx %9zu\n", buildTime / 1e6,
+                   megabytesPerSecond(size, generatedTime), megabytesPerSecond(size, dfaTime),
+                   megabytesPerSecond(size, nfaTime), generatedTime > 0 ? (double)nfaTime / generatedTime : 0.0,
+                   matches);
+        }
+        free(corpus);
+    }
+    return 0;
+}
+
+// --------------------------------------------------------------------------- // 
+// --------------------------------------------------------------------------- // 
+
+/*
+    Compressed input
+
+    Writes the log corpus at sizes on and next to multiples of the blocks pda
+    decompresses into, compresses each with gzip, with gzip followed by a 10 KiB
+    run of zero bytes (as tape and block-padded writers leave), and with zstd where
+    it is installed, and counts the lines holding ERROR with `pda -c` (./pda, or
+    $PDA) in the plain and the compressed file. pda must be built with -DPDA_ZLIB
+    and -DPDA_ZSTD. A count that differs, or a search that fails, fails the run.
+    The time each search takes is compared with decompressing into pda through a
+    pipe.
+*/
+
+#define COMPRESSED_BLOCK_SIZE (256 * 1024)      // RING_BLOCK_SIZE in pda.c
+
+struct Compressor {
+    const char *name;
+    const char *extension;
+    const char *compress;       // Shell commands, reading a file and writing to stdout
+    const char *decompress;
+};
+
+static const struct Compressor compressors[] = {
+    { "gzip", ".gz", "gzip -c", "gzip -dc" },
+    { "gzip+0", ".gz", "padded() { gzip -c \"$1\"; head -c 10240 /dev/zero; }; padded", "gzip -dc" },
+    { "zstd", ".zst", "zstd -q -c", "zstd -q -dc" },
+};
+
+// Runs a shell command that prints a count and returns the count, or -1 if the
+// command failed
+static long runCount(const char *command, uint64_t *time) {
+    uint64_t start = nowNanoseconds();
+    FILE *output = popen(command, "r");
+    if (!output) {
+        return -1;
+    }
+    long count;
+    if (fscanf(output, "%ld", &count) != 1) {
+        count = -1;
+    }
+    int status = pclose(output);
+    *time = nowNanoseconds() - start;
+    return status != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? count : -1;
+}
+
+static int compressedCommand(int argc, char *argv[]) {
+    if (argc != 2) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    const char *pda = getenv("PDA") ? getenv("PDA") : "./pda";
+    static const size_t blockCounts[] = { 1, 2, 8 };
+    char path[] = "/tmp/pda-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Could not create a temporary file\n");
+        return 1;
+    }
+    close(fd);
+
+    int status = 0;
+    printf("%-10s %-6s %9s %9s %10s %10s\n", "size", "format", "matches", "plain", "search", "pipe");
+    for (size_t b = 0; b < sizeof(blockCounts) / sizeof(blockCounts[0]); b++) {
+        for (int delta = -1; delta <= 1; delta++) {
+            size_t size = blockCounts[b] * COMPRESSED_BLOCK_SIZE + delta;
+            char *corpus = generateCorpus(CORPUS_LOG, size);
+            bool written = writeFile(path, corpus, size);
+            free(corpus);
+            char command[512];
+            uint64_t time, pipeTime;
+            snprintf(command, sizeof(command), "'%s' -c ERROR '%s'", pda, path);
+            long plain = written ? runCount(command, &time) : -1;
+            if (plain < 0) {
+                fprintf(stderr, "Error: Could not search the corpus with '%s'\n", pda);
+                unlink(path);
+                return 1;
+            }
+
+            for (size_t c = 0; c < sizeof(compressors) / sizeof(compressors[0]); c++) {
+                const struct Compressor *comp = &compressors[c];
+                char compressed[sizeof(path) + 8];
+                snprintf(compressed, sizeof(compressed), "%s%s", path, comp->extension);
+                snprintf(command, sizeof(command), "%s '%s' > '%s' 2> /dev/null", comp->compress, path, compressed);
+                if (system(command) != 0) {
+                    // The compressor is not installed
+                    unlink(compressed);
+                    continue;
+                }
+                snprintf(command, sizeof(command), "'%s' -c ERROR '%s'", pda, compressed);
+                long matches = runCount(command, &time);
+                snprintf(command, sizeof(command), "%s '%s' | '%s' -c ERROR -", comp->decompress, compressed, pda);
+                runCount(command, &pipeTime);
+                unlink(compressed);
+
+                printf("%-10zu %-6s %9ld %9ld %8.1fms %8.1fms%s\n", size, comp->name, matches, plain, time / 1e6,
+                       pipeTime / 1e6, matches != plain ? "  FAILED" : "");
+                if (matches != plain) {
+                    status = 1;
+                }
+            }
+        }
+    }
+    unlink(path);
+    return status;
+}
+
+// --------------------------------------------------------------------------- // 
+// --------------------------------------------------------------------------- // 
+
+/*
+    Line mode
+
+    Searches LINES_INPUT with `pda -c`, `-v` and `-n` (./pda, or $PDA) and compares
+    the output with what grep prints for the same options and pattern. Patterns
+    that can match the empty string match every line, empty lines included. An
+    output that differs, or a search that fails, fails the run.
+*/
+
+#define LINES_INPUT "x\n\nab\n"
+
+struct LineCase {
+    const char *options;
+    const char *pattern;
+    const char *expected;
+};
+
+static const struct LineCase lineCases[] = {
+    { "-c", "a*", "3\n" },
+    { "-c", "b*", "3\n" },
+    { "-c", ".?", "3\n" },
+    { "-c", "ab", "1\n" },
+    { "-v", "a*", "" },
+    { "-v", "b*", "" },
+    { "-v", ".?", "" },
+    { "-v", "ab", "x\n\n" },
+    { "-n", "a*", "1:x\n2:\n3:ab\n" },
+    { "-n", "b*", "1:x\n2:\n3:ab\n" },
+    { "-n", ".?", "1:x\n2:\n3:ab\n" },
+    { "-n", "ab", "3:ab\n" },
+};
+
+// Runs a shell command and returns what it printed, or NULL if the command failed
+static char *runOutput(const char *command) {
+    FILE *output = popen(command, "r");
+    if (!output) {
+        return NULL;
+    }
+    size_t length = 0, capacity = 256;
+    char *text = malloc(capacity);
+    size_t n;
+    while ((n = fread(text + length, 1, capacity - 1 - length, output)) > 0) {
+        length += n;
+        if (length == capacity - 1) {
+            capacity *= 2;
+            text = realloc(text, capacity);
+        }
+    }
+    text[length] = '\0';
+    int status = pclose(output);
+    if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
+
+static int linesCommand(int argc, char *argv[]) {
+    if (argc != 2) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    const char *pda = getenv("PDA") ? getenv("PDA") : "./pda";
+    char path[] = "/tmp/pda-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Could not create a temporary file\n");
+        return 1;
+    }
+    close(fd);
+    if (!writeFile(path, LINES_INPUT, strlen(LINES_INPUT))) {
+        fprintf(stderr, "Error: Could not write '%s'\n", path);
+        unlink(path);
+        return 1;
+    }
+
+    int status = 0;
+    printf("%-8s %-8s %s\n", "options", "pattern", "result");
+    for (size_t i = 0; i < sizeof(lineCases) / sizeof(lineCases[0]); i++) {
+        const struct LineCase *lc = &lineCases[i];
+        char command[512];
+        snprintf(command, sizeof(command), "'%s' %s '%s' '%s'", pda, lc->options, lc->pattern, path);
+        char *output = runOutput(command);
+        bool ok = output && strcmp(output, lc->expected) == 0;
+        printf("%-8s %-8s %s\n", lc->options, lc->pattern, ok ? "ok" : output ? "FAILED" : "FAILED to run");
+        if (!ok) {
+            status = 1;
+        }
+        free(output);
+    }
+    unlink(path);
+    return status;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "gen") == 0) {
+        return generateCommand(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "codegen") == 0) {
+        return codegenCommand(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "compressed") == 0) {
+        return compressedCommand(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "lines") == 0) {
+        return linesCommand(argc, argv);
+    }
+
+    size_t megabytes = BENCH_DEFAULT_MEGABYTES;
+    int repeat = BENCH_DEFAULT_REPEAT;
+    bool useGrep = true;
+    bool tsv = false;
+    for (int i = 1; i < argc; i++) {
+        char *end = "";
+        if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            megabytes = strtoul(argv[++i], &end, 10);
+        } else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+            repeat = atoi(argv[++i]);
+            end = repeat < 1 ? "x" : "";
+        } else if (strcmp(argv[i], "--no-grep") == 0) {
+            useGrep = false;
+        } else if (strcmp(argv[i], "--tsv") == 0) {
+            tsv = true;
+        } else {
+            end = "x";
+        }
+        if (*end || megabytes == 0) {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    size_t size = megabytes << 20;
+
+    if (tsv) {
+        printf("corpus\tpattern\tcompile_ns\tdfa_ns\tbit_ns\tnfa_ns\tmatch_p50_ns\tmatch_p99_ns\tmatches\t"
+               "grep_ns\tgrep_matches\n");
+    } else {
+        printf("%-13s %-16s %10s %10s %10s %10s %10s %10s %9s %10s %9s\n", "corpus", "pattern", "compile",
+               "dfa MB/s", "bit MB/s", "nfa MB/s", "p50/match", "p99/match", "matches", "grep MB/s", "grep -o");
+    }
+
+    for (int c = 0; c < NUM_CORPORA; c++) {
+        char *corpus = generateCorpus((enum Corpus)c, size);
+
+        // grep needs the corpus in a file
+        char path[] = "/tmp/pda-bench-XXXXXX";
+        bool haveFile = false;
+        if (useGrep) {
+            int fd = mkstemp(path);
+            if (fd >= 0) {
+                close(fd);
+                haveFile = writeFile(path, corpus, size);
+            }
+        }
+
+        for (size_t i = 0; i < NUM_BENCH_CASES; i++) {
+            const struct BenchCase *bc = &benchCases[i];
+            if ((int)bc->corpus != c) {
+                continue;
+            }
+            struct BenchResult r = runCase(bc, corpus, size, haveFile ? path : NULL, repeat);
+
+            if (tsv) {
+                printf("%s\t%s\t%llu\t%llu\t", corpusNames[c], bc->pattern, (unsigned long long)r.compileTime,
+                       (unsigned long long)r.dfaTime);
+                if (r.bitTime > 0) {
+                    printf("%llu", (unsigned long long)r.bitTime);
+                }
+                printf("\t%llu\t%llu\t%llu\t%zu\t", (unsigned long long)r.nfaTime, (unsigned long long)r.matchP50,
+                       (unsigned long long)r.matchP99, r.matches);
+                if (r.ranGrep) {
+                    printf("%llu\t%zu\n", (unsigned long long)r.grepTime, r.grepMatches);
+                } else {
+                    printf("\t\n");
+                }
+                continue;
+            }
+
+            printf("%-13s %-16s %8.1fus %10.1f", corpusNames[c], bc->pattern, r.compileTime / 1e3,
+                   megabytesPerSecond(size, r.dfaTime));
+            if (r.bitTime > 0) {
+                printf(" %10.1f", megabytesPerSecond(size, r.bitTime));
+            } else {
+                printf(" %10s", "-");
+            }
+            printf(" %10.1f", megabytesPerSecond(size, r.nfaTime));
+            if (r.matches > 0) {
+                printf(" %8.2fus %8.2fus", r.matchP50 / 1e3, r.matchP99 / 1e3);
+            } else {
+                printf(" %10s %10s", "-", "-");
+            }
+            printf(" %9zu", r.matches);
+            if (r.ranGrep) {
+                printf(" %10.1f %9zu%s", megabytesPerSecond(size, r.grepTime), r.grepMatches,
+                       r.grepMatches != r.matches ? "*" : "");
+            }
+            printf("\n");
+        }
+
+        if (haveFile) {
+            unlink(path);
+        }
+        free(corpus);
+    }
+    return 0;
+}
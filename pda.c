@@ -1,8 +1,94 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <ctype.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef PDA_ZLIB
+#include <zlib.h>
+#endif
+#ifdef PDA_ZSTD
+#include <zstd.h>
+#endif
+#include "pda.h"
+
+/*
+    Statistics
+
+    Built with -DPDA_STATS, the matcher counts what it does as it goes and --stats
+    reports the totals on stderr once the search is over. Each thread counts into
+    a struct Stats of its own, which is added to the totals when the thread is
+    done. Otherwise the STAT_ macros expand to nothing and their arguments are never
+    evaluated, so the search loops compile exactly as if they were not there.
+*/
+
+#ifdef PDA_STATS
+#include <inttypes.h>
+
+enum StatsEngine {
+    ENGINE_NFA,
+    ENGINE_REVERSE,
+    ENGINE_DFA,
+    ENGINE_BIT_PARALLEL,
+    ENGINE_COUNTERS,
+    ENGINE_LITERALS,
+    NUM_ENGINES
+};
+
+struct Stats {
+    uint64_t compileNanos;
+    uint64_t searchNanos;
+    uint64_t nfaStates;
+    uint64_t nfaTransitions;        // Added by constructNFA, including copies
+    uint64_t reallocs;
+    uint64_t inputBytes;            // Of the files searched
+    uint64_t runs[NUM_ENGINES];     // Calls of each engine
+    uint64_t bytes[NUM_ENGINES];    // Bytes each engine stepped through
+    uint64_t threadSteps;           // Steps of a thread list, and the threads in it
+    uint64_t threads;
+    uint64_t maxThreads;
+    uint64_t closureStates;         // States taken off the stack following epsilon edges
+    uint64_t dfaHits;               // Transitions found in the DFA cache
+    uint64_t dfaMisses;             // Transitions built by subset construction
+    uint64_t dfaFlushes;
+    uint64_t dfaGaveUp;
+    uint64_t prefilterLookups;
+    uint64_t prefilterCandidates;   // Lookups that found the literal
+    uint64_t prefilterSkipped;      // Bytes jumped over
+    uint64_t cacheHits;             // Programs loaded from the pattern cache
+    uint64_t cacheMisses;
+    uint64_t indexBlocks;           // Blocks of the trigram index, and those searched
+    uint64_t indexCandidates;
+};
+
+static __thread struct Stats threadStats;
+
+#define STAT_ADD(field, n) (threadStats.field += (n))
+#define STAT_MAX(field, n) (threadStats.field = (n) > threadStats.field ? (n) : threadStats.field)
+#else
+#define STAT_ADD(field, n) ((void)0)
+#define STAT_MAX(field, n) ((void)0)
+#endif
+
+// --------------------------------------------------------------------------- // 
+// --------------------------------------------------------------------------- // 
+
+// 256-bit set of byte values
+struct ByteSet {
+    uint64_t bits[4];
+};
 
 struct State {
     struct Transition *transitions;
@@ -11,16 +97,133 @@ struct State {
 };
 
 struct Transition {
-    struct State *next;
-    bool wildcard;
-    char *transitionChars;
+    size_t next;            // Index of the target state
+    bool epsilon;
+    bool negated;           // A wildcard or negated class, which in line mode never matches a newline
+    struct ByteSet chars;   // Bytes the transition consumes
+    uint32_t min, max;      // How many bytes of chars it consumes: 1 and 1 unless counted (see '{')
+};
+
+// Literal that every match starts with, used to skip ahead to candidate positions
+struct Prefilter {
+    char *literal;
+    size_t length;          // 0 if the pattern has no literal prefix
+    size_t rare1, rare2;    // Offsets of the two rarest bytes in literal
 };
 
 struct NFA {
     struct State *states;
     size_t numStates;
+    struct Prefilter prefilter;
+    const char *error;      // Set, with no states, if the pattern is invalid
+};
+
+// Consuming edge of a compiled state
+struct Edge {
+    struct ByteSet chars;
+    uint32_t next;
+};
+
+#define COUNTER_UNBOUNDED UINT32_MAX    // Maximum of {n,}
+
+/*
+    State that consumes min to max bytes of chars before moving on to exit, compiled
+    from a counted transition (see constructNFA). A thread list holds all the counts
+    reached in it at once, as a bitmap of numWords words from word on in the list's
+    counts: bit k is set once k bytes have been consumed. An unbounded counter only
+    counts up to min, where its bit stays set.
+*/
+struct Counter {
+    struct ByteSet chars;
+    uint32_t min;
+    uint32_t max;           // COUNTER_UNBOUNDED for {n,}
+    uint32_t entry;         // State whose epsilon edge leads here
+    uint32_t exit;
+    uint32_t word;
+    uint32_t numWords;
+};
+
+/*
+    Compiled form of one or more NFAs (see compileNFA). State 0 is the start state.
+    The consuming edges of state s are edges[edgeStart[s] .. edgeStart[s + 1]), and
+    its epsilon edges lead to epsilons[epsilonStart[s] .. epsilonStart[s + 1]).
+    Its epsilon closure, s first, is closures[closureStart[s] .. closureStart[s + 1])
+    unless closures is NULL (see computeClosures). pattern[s] is the number of the
+    pattern state s was compiled from. The last numCounters states are counter
+    states, which have no edges of their own.
+*/
+struct Program {
+    uint32_t numStates;
+    uint32_t numPatterns;
+    uint32_t *edgeStart;
+    struct Edge *edges;
+    uint32_t *epsilonStart;
+    uint32_t *epsilons;
+    uint32_t *closureStart;
+    uint32_t *closures;
+    bool *accept;
+    uint32_t *pattern;
+    struct Counter *counters;       // Of the states from firstCounter on
+    uint32_t numCounters;
+    uint32_t firstCounter;
+    uint32_t numCountWords;         // Words of counts a thread list needs for all of them
+    struct Prefilter prefilter;
+    struct LiteralSet *literals;    // Set when every pattern is a plain string
+    struct Glushkov *glushkov;      // Set when the program is small enough
+    struct Program *reverse;        // Same states with every edge turned around
+    uint32_t emptyPattern;          // Lowest-numbered pattern matching the empty string, or numPatterns
+    uint8_t byteClass[256];         // Class of each byte, see computeByteClasses
+    uint32_t numByteClasses;
+
+    // Set on a program loaded from the pattern cache (see loadProgram), whose
+    // arrays point into the mapped cache file
+    void *mapping;
+    size_t mappingSize;
+    const uint32_t *dfaStates;      // Saved DFA states newDFA starts out with (see dfaSnapshot)
+    uint32_t numDfaStates;
+};
+
+// Match positions are relative to the searched buffer or, from a MatchIterator,
+// to the whole stream
+struct Match {
+    size_t start;
+    size_t length;
+    uint32_t pattern;       // Lowest-numbered pattern matching this span
 };
 
+static inline bool byteSetHas(const struct ByteSet *set, unsigned char ch) {
+    return (set->bits[ch >> 6] >> (ch & 63)) & 1;
+}
+
+static inline void byteSetAdd(struct ByteSet *set, unsigned char ch) {
+    set->bits[ch >> 6] |= (uint64_t)1 << (ch & 63);
+}
+
+// Adds ch, and if caseless its other case as well
+static void byteSetAddCase(struct ByteSet *set, unsigned char ch, bool caseless) {
+    byteSetAdd(set, ch);
+    if (caseless && ch >= 'a' && ch <= 'z') {
+        byteSetAdd(set, (unsigned char)(ch - 'a' + 'A'));
+    } else if (caseless && ch >= 'A' && ch <= 'Z') {
+        byteSetAdd(set, (unsigned char)(ch - 'A' + 'a'));
+    }
+}
+
+// Returns the only byte in the set, or -1 if it holds none or several
+static int byteSetSingle(const struct ByteSet *set) {
+    int found = -1;
+    for (int i = 0; i < 4; i++) {
+        if (set->bits[i] == 0) {
+            continue;
+        }
+        if (found >= 0 || (set->bits[i] & (set->bits[i] - 1)) != 0) {
+            return -1;
+        }
+        found = 64 * i + __builtin_ctzll(set->bits[i]);
+    }
+    return found;
+}
+
 struct State newState(bool accepting) {
     struct State st = {
         .accept = accepting,
@@ -30,553 +233,5458 @@ struct State newState(bool accepting) {
     return st;
 }
 
+// The transitions array doubles whenever its size reaches a power of two
 void addTransition(struct State *st, struct Transition tr) {
-    if (st->numTransitions > 0) {
-        st->transitions = realloc(st->transitions, (++st->numTransitions)*sizeof(struct Transition));
-    } else {
-        st->transitions = malloc((++st->numTransitions)*sizeof(struct Transition));
+    STAT_ADD(nfaTransitions, 1);
+    size_t n = st->numTransitions;
+    if ((n & (n - 1)) == 0) {
+        STAT_ADD(reallocs, n > 0);
+        st->transitions = realloc(st->transitions, (n > 0 ? 2 * n : 1) * sizeof(struct Transition));
     }
-    st->transitions[st->numTransitions-1] = tr;
+    st->transitions[st->numTransitions++] = tr;
 }
 
-struct Transition newTransition(const char *tchars, struct State *next) {
+struct Transition newTransition(const struct ByteSet *chars, bool negated, size_t next) {
     struct Transition tr = {
         .next = next,
-        .wildcard = false,
-        .transitionChars = malloc(sizeof(char)*strlen(tchars)+1)
+        .epsilon = false,
+        .negated = negated,
+        .chars = *chars,
+        .min = 1,
+        .max = 1
     };
-    strcpy(tr.transitionChars, tchars);
     return tr;
 }
 
-struct Transition newWildcardTransition(struct State *next) {
+struct Transition newEpsilonTransition(size_t next) {
     struct Transition tr = {
         .next = next,
-        .wildcard = true,
-        .transitionChars = malloc(1)
+        .epsilon = true,
+        .negated = false,
+        .chars = {{0}},
+        .min = 0,
+        .max = 0
     };
-    tr.transitionChars[0] = '\0';
     return tr;
 }
 
+
 // --------------------------------------------------------------------------- // 
 // --------------------------------------------------------------------------- // 
 
-static bool addStateIfNew(struct State ***stateSet, size_t *numStates, size_t *capacity, struct State *state) {
-    // Check if already in set
-    for (size_t i = 0; i < *numStates; i++) {
-        if ((*stateSet)[i] == state) {
-            return false;
+/*
+    Literal prefilter
+
+    Most patterns start with a literal. Rather than stepping the automaton through
+    every byte that cannot begin a match, the search jumps straight to the next
+    occurrence of that literal. Candidates are located by the two bytes of the
+    literal that are least likely to occur in text (16 positions at a time with
+    SSE2, otherwise memchr on the rarest one) and then verified with memcmp.
+*/
+
+// Bytes roughly from most to least common in text and logs. Anything missing
+// (control characters, high bytes) is considered rarer than all of these.
+static const char *commonBytes =
+    " etaoinsrhldcumfpgwybvkxjqzETAOINSRHLDCUMFPGWYBVKXJQZ0123456789\n.,:-_/=\"'()[]<>;+*#@!?&%$|{}~^`\\\t";
+
+static size_t byteFrequency(unsigned char ch) {
+    const char *found = ch ? strchr(commonBytes, ch) : NULL;
+    return found ? strlen(commonBytes) - (size_t)(found - commonBytes) : 0;
+}
+
+// Collects the chain of single-character transitions every match has to start
+// with: it ends at the first state that branches, loops, accepts, takes a class
+// or counts
+static struct Prefilter findLiteralPrefix(struct State *states, size_t numStates) {
+    struct Prefilter pf = {
+        .literal = malloc(numStates),
+        .length = 0
+    };
+
+    struct State *current = &states[0];
+    while (!current->accept && current->numTransitions == 1 && pf.length < numStates) {
+        struct Transition *tr = &current->transitions[0];
+        int ch = tr->epsilon || tr->negated || tr->max != 1 ? -1 : byteSetSingle(&tr->chars);
+        if (ch < 0 || &states[tr->next] == current) {
+            break;
         }
+        pf.literal[pf.length++] = (char)ch;
+        current = &states[tr->next];
     }
 
-    // Expand capacity if needed
-    if (*numStates >= *capacity) {
-        *capacity = (*capacity == 0) ? 8 : (*capacity * 2);
-        *stateSet = realloc(*stateSet, *capacity * sizeof(struct State *));
+    pf.rare1 = 0;
+    pf.rare2 = 0;
+    for (size_t i = 1; i < pf.length; i++) {
+        size_t freq = byteFrequency(pf.literal[i]);
+        if (freq < byteFrequency(pf.literal[pf.rare1])) {
+            pf.rare2 = pf.rare1;
+            pf.rare1 = i;
+        } else if (pf.rare2 == pf.rare1 || freq < byteFrequency(pf.literal[pf.rare2])) {
+            pf.rare2 = i;
+        }
     }
-
-    (*stateSet)[(*numStates)++] = state;
-    return true;
+    return pf;
 }
 
-static void epsilonClosure(struct State ***stateSet, size_t *numStates, size_t *capacity, size_t **startPositions) {
-    for (size_t i = 0; i < *numStates; i++) {
-        struct State *current = (*stateSet)[i];
+// Returns the offset of the first occurrence of the literal in input, or length
+// if there is none
+static size_t findPrefix(const struct Prefilter *pf, const char *input, size_t length) {
+    STAT_ADD(prefilterLookups, 1);
+    if (length < pf->length) {
+        return length;
+    }
+    size_t last = length - pf->length;  // Last offset an occurrence can start at
+    size_t pos = 0;
 
-        for (size_t tr = 0; tr < current->numTransitions; tr++) {
-            if (strlen(current->transitions[tr].transitionChars) == 0 && !current->transitions[tr].wildcard) {
-                // Check if already in set
-                bool found = false;
-                for (size_t j = 0; j < *numStates; j++) {
-                    if ((*stateSet)[j] == current->transitions[tr].next) {
-                        found = true;
-                        break;
-                    }
+#ifdef __SSE2__
+    if (pf->rare1 != pf->rare2) {
+        __m128i byte1 = _mm_set1_epi8(pf->literal[pf->rare1]);
+        __m128i byte2 = _mm_set1_epi8(pf->literal[pf->rare2]);
+        for (; pos + 16 <= last + 1; pos += 16) {
+            __m128i block1 = _mm_loadu_si128((const __m128i *)(input + pos + pf->rare1));
+            __m128i block2 = _mm_loadu_si128((const __m128i *)(input + pos + pf->rare2));
+            unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block1, byte1),
+                                                            _mm_cmpeq_epi8(block2, byte2)));
+            while (mask) {
+                size_t candidate = pos + __builtin_ctz(mask);
+                if (memcmp(input + candidate, pf->literal, pf->length) == 0) {
+                    STAT_ADD(prefilterCandidates, 1);
+                    return candidate;
                 }
+                mask &= mask - 1;
+            }
+        }
+    }
+#endif
 
-                if (!found) {
-                    if (*numStates >= *capacity) {
-                        *capacity = (*capacity == 0) ? 8 : (*capacity * 2);
-                        *stateSet = realloc(*stateSet, *capacity * sizeof(struct State *));
-                        *startPositions = realloc(*startPositions, *capacity * sizeof(size_t));
-                    }
-                    (*stateSet)[*numStates] = current->transitions[tr].next;
-                    (*startPositions)[*numStates] = (*startPositions)[i];  // Inherit start position
-                    (*numStates)++;
-                }
+    while (pos <= last) {
+        const char *hit = memchr(input + pos + pf->rare1, pf->literal[pf->rare1], last - pos + 1);
+        if (!hit) {
+            break;
+        }
+        size_t candidate = (size_t)(hit - input) - pf->rare1;
+        if (memcmp(input + candidate, pf->literal, pf->length) == 0) {
+            STAT_ADD(prefilterCandidates, 1);
+            return candidate;
+        }
+        pos = candidate + 1;
+    }
+    return length;
+}
+
+// Where a search that found no literal in input[from, length) has to resume
+// once more input arrives: the literal may straddle the end of the buffer
+static size_t prefixResume(const struct Prefilter *pf, size_t from, size_t length) {
+    size_t tail = pf->length - 1;
+    return length - from > tail ? length - tail : from;
+}
+
+// --------------------------------------------------------------------------- // 
+// --------------------------------------------------------------------------- // 
+
+/*
+    The simulation keeps its threads in two thread lists, one for the current
+    position and one for the next, which are swapped after every byte. Each list is
+    a sparse set over the program's states: dense holds the states in the order
+    they were added and sparse maps a state to its index in dense, so insertion,
+    membership and clearing are all O(1) without the arrays ever being reset.
+
+    Threads are added in order of their start position, and each one is followed
+    through its epsilon closure as it is added. A state already in the list is
+    therefore held by the earliest-starting thread that can reach it, and the first
+    accepting state in the list belongs to the earliest match.
+
+    A counter state holds the counts of every thread in it under the start of the
+    first, so a program with counters is only run here anchored, where all threads
+    share one start. runCounters finds where its matches end instead.
+*/
+struct ThreadList {
+    uint32_t *dense;
+    uint32_t *sparse;       // Indexed by state, only meaningful for states in dense
+    size_t *starts;         // Start position of the thread in each state
+    uint64_t *counts;       // Counts held in each counter state (see struct Counter)
+    size_t size;
+};
+
+struct NFAScratch {
+    struct ThreadList lists[2];
+    uint32_t *stack;        // For following epsilon edges
+};
+
+struct NFAScratch *newNFAScratch(const struct Program *prog) {
+    size_t n = prog->numStates;
+    struct NFAScratch *scratch = malloc(sizeof(struct NFAScratch));
+    for (int i = 0; i < 2; i++) {
+        scratch->lists[i].dense = malloc(n * sizeof(uint32_t));
+        scratch->lists[i].sparse = calloc(n, sizeof(uint32_t));
+        scratch->lists[i].starts = malloc(n * sizeof(size_t));
+        scratch->lists[i].counts = malloc(prog->numCountWords * sizeof(uint64_t));
+        scratch->lists[i].size = 0;
+    }
+    scratch->stack = malloc(n * sizeof(uint32_t));
+    return scratch;
+}
+
+void freeNFAScratch(struct NFAScratch *scratch) {
+    for (int i = 0; i < 2; i++) {
+        free(scratch->lists[i].dense);
+        free(scratch->lists[i].sparse);
+        free(scratch->lists[i].starts);
+        free(scratch->lists[i].counts);
+    }
+    free(scratch->stack);
+    free(scratch);
+}
+
+static inline bool threadListHas(const struct ThreadList *list, uint32_t state) {
+    uint32_t i = list->sparse[state];
+    return i < list->size && list->dense[i] == state;
+}
+
+static inline void threadListAdd(struct ThreadList *list, uint32_t state, size_t start) {
+    list->sparse[state] = (uint32_t)list->size;
+    list->dense[list->size++] = state;
+    list->starts[state] = start;
+}
+
+// Adds a thread in state unless the list already holds one there, and returns
+// whether it did. A counter state is entered with a count of 0 either way.
+static inline bool enterThread(const struct Program *prog, struct ThreadList *list, uint32_t state,
+                               size_t start) {
+    bool added = !threadListHas(list, state);
+    if (added) {
+        threadListAdd(list, state, start);
+    }
+    if (state >= prog->firstCounter) {
+        const struct Counter *counter = &prog->counters[state - prog->firstCounter];
+        uint64_t *counts = list->counts + counter->word;
+        if (added) {
+            memset(counts, 0, counter->numWords * sizeof(uint64_t));
+        }
+        counts[0] |= 1;
+    }
+    return added;
+}
+
+// Adds a thread in state, and in every state reachable from it through epsilon
+// edges, unless an earlier-starting thread already holds them
+static void addThread(const struct Program *prog, struct ThreadList *list, uint32_t *stack,
+                      uint32_t state, size_t start) {
+    if (!enterThread(prog, list, state, start)) {
+        return;
+    }
+    if (prog->closures) {
+        STAT_ADD(closureStates, prog->closureStart[state + 1] - prog->closureStart[state]);
+        for (uint32_t i = prog->closureStart[state] + 1; i < prog->closureStart[state + 1]; i++) {
+            enterThread(prog, list, prog->closures[i], start);
+        }
+        return;
+    }
+
+    size_t top = 0;
+    stack[top++] = state;
+    while (top > 0) {
+        uint32_t current = stack[--top];
+        STAT_ADD(closureStates, 1);
+        if (current >= prog->firstCounter) {
+            // A counter with no minimum can be left having counted nothing
+            const struct Counter *counter = &prog->counters[current - prog->firstCounter];
+            if (counter->min == 0 && enterThread(prog, list, counter->exit, start)) {
+                stack[top++] = counter->exit;
+            }
+            continue;
+        }
+        for (uint32_t e = prog->epsilonStart[current]; e < prog->epsilonStart[current + 1]; e++) {
+            uint32_t target = prog->epsilons[e];
+            if (enterThread(prog, list, target, start)) {
+                stack[top++] = target;
+            }
+        }
+    }
+}
+
+// Counts byte c in the counter state of current into next, which may already hold
+// counts there, and moves on to the exit if any count now lies within the range
+static void stepCounter(const struct Program *prog, uint32_t *stack, const struct ThreadList *current,
+                        struct ThreadList *next, uint32_t state, unsigned char c) {
+    const struct Counter *counter = &prog->counters[state - prog->firstCounter];
+    if (!byteSetHas(&counter->chars, c)) {
+        return;
+    }
+    const uint64_t *from = current->counts + counter->word;
+    uint64_t *to = next->counts + counter->word;
+    bool fresh = !threadListHas(next, state);
+    uint32_t top = counter->max != COUNTER_UNBOUNDED ? counter->max : counter->min;
+    uint64_t carry = 0, alive = 0, inRange = 0;
+    for (uint32_t w = 0; w < counter->numWords; w++) {
+        uint64_t shifted = from[w] << 1 | carry;
+        carry = from[w] >> 63;
+        if (w == top / 64) {
+            // Drop counts past the maximum, or keep an unbounded one at its minimum
+            uint64_t topBit = (uint64_t)1 << (top % 64);
+            shifted &= topBit | (topBit - 1);
+            if (counter->max == COUNTER_UNBOUNDED) {
+                shifted |= from[w] & topBit;
+            }
+        }
+        to[w] = fresh ? shifted : to[w] | shifted;
+        alive |= to[w];
+        if (64 * (w + 1) > counter->min) {
+            inRange |= 64 * w >= counter->min ? to[w] : to[w] >> (counter->min % 64);
+        }
+    }
+    if (alive == 0) {
+        return;
+    }
+    if (fresh) {
+        threadListAdd(next, state, current->starts[state]);
+    }
+    if (inRange) {
+        addThread(prog, next, stack, counter->exit, current->starts[state]);
+    }
+}
+
+// Moves every thread in current over byte c into next. The current list is
+// ordered by start position, so the next one ends up ordered too.
+static inline void stepThreads(const struct Program *prog, uint32_t *stack, const struct ThreadList *current,
+                               struct ThreadList *next, unsigned char c) {
+    STAT_ADD(threadSteps, 1);
+    STAT_ADD(threads, current->size);
+    STAT_MAX(maxThreads, current->size);
+    next->size = 0;
+    for (size_t i = 0; i < current->size; i++) {
+        uint32_t state = current->dense[i];
+        if (state >= prog->firstCounter) {
+            stepCounter(prog, stack, current, next, state, c);
+            continue;
+        }
+        for (uint32_t e = prog->edgeStart[state]; e < prog->edgeStart[state + 1]; e++) {
+            const struct Edge *edge = &prog->edges[e];
+            if (byteSetHas(&edge->chars, c)) {
+                addThread(prog, next, stack, edge->next, current->starts[state]);
             }
         }
     }
 }
 
-int runNFA(struct State *start, char *input, bool search, bool greedy, int *matchLength) {
-    size_t capacity = 8;
-    size_t numCurrentStates = 1;
-    struct State **currentStates = malloc(capacity * sizeof(struct State *));
-    size_t *startPositions = malloc(capacity * sizeof(size_t));
-    currentStates[0] = start;
-    startPositions[0] = 0;
+/*
+    Runs the NFA over the first length bytes of input. Returns whether a non-empty
+    match was found, filling in *match.
+
+    If final is false more input may follow, and a match that could still grow or
+    be beaten past the end of input is not reported. In that case (and when there
+    is no match) *resume is set to the offset the search has to be rerun from once
+    more input is available: no match can start before it.
+*/
+bool runNFA(const struct Program *prog, struct NFAScratch *scratch, const char *input, size_t length,
+            bool search, bool greedy, bool final, struct Match *match, size_t *resume) {
+    const uint32_t start = 0;
+    const struct Prefilter *prefilter = search && prog->prefilter.length > 0 ? &prog->prefilter : NULL;
+    struct ThreadList *current = &scratch->lists[0];
+    struct ThreadList *next = &scratch->lists[1];
+    current->size = 0;
+    addThread(prog, current, scratch->stack, start, 0);
+    STAT_ADD(runs[ENGINE_NFA], 1);
     
     // Track the best (longest) match found so far
-    int bestMatchStart = -1;
-    int bestMatchLength = 0;
-    int firstMatchStart = -1;  // For search mode - lock onto first match position
-    
-    // Compute initial epsilon closure
-    epsilonClosure(&currentStates, &numCurrentStates, &capacity, &startPositions);
+    bool haveMatch = false;
+    struct Match best = {0};
+    size_t lastRestart = 0;     // Last position at which no thread was alive
     
     // Process each character
-    size_t pos = 0;
-    for (char *c = input; *c; c++, pos++) {
-        size_t nextCapacity = 8;
-        size_t numNextStates = 0;
-        struct State **nextStates = malloc(nextCapacity * sizeof(struct State *));
-        size_t *nextStartPositions = malloc(nextCapacity * sizeof(size_t));
-        
-        // For each current state, find transitions on character *c
-        for (size_t i = 0; i < numCurrentStates; i++) {
-            struct State *current = currentStates[i];
-            
-            for (size_t tr = 0; tr < current->numTransitions; tr++) {
-                bool matches;
-                if (!(matches = current->transitions[tr].wildcard)) {
-                    for (char *tc = current->transitions[tr].transitionChars; *tc; tc++) {
-                        if (*tc == *c) {
-                            matches = true;
-                            break;
-                        }
-                    }
-                }
-                
-                if (matches) {
-                    bool found = false;
-                    for (size_t j = 0; j < numNextStates; j++) {
-                        if (nextStates[j] == current->transitions[tr].next) {
-                            found = true;
-                            break;
-                        }
-                    }
-                    
-                    if (!found) {
-                        if (numNextStates >= nextCapacity) {
-                            nextCapacity *= 2;
-                            nextStates = realloc(nextStates, nextCapacity * sizeof(struct State *));
-                            nextStartPositions = realloc(nextStartPositions, nextCapacity * sizeof(size_t));
-                        }
-                        nextStates[numNextStates] = current->transitions[tr].next;
-                        nextStartPositions[numNextStates] = startPositions[i];
-                        numNextStates++;
-                    }
-                }
+    for (size_t pos = 0; pos < length; pos++) {
+        // With no thread alive, jump to where the literal prefix occurs next
+        if (prefilter && lastRestart == pos) {
+            size_t candidate = pos + findPrefix(prefilter, input + pos, length - pos);
+            STAT_ADD(prefilterSkipped, candidate - pos);
+            if (candidate == length) {
+                lastRestart = prefixResume(prefilter, pos, length);
+                break;
+            }
+            if (candidate > pos) {
+                current->size = 0;
+                addThread(prog, current, scratch->stack, start, candidate);
+                pos = lastRestart = candidate;
             }
         }
         
+        // For each current state, find transitions on the character
+        STAT_ADD(bytes[ENGINE_NFA], 1);
+        stepThreads(prog, scratch->stack, current, next, (unsigned char)input[pos]);
+        
         // In search mode, keep the start state active
-        // If greedy, only keep active until we find first match
-        if (search && (!greedy || firstMatchStart == -1)) {
-            bool found = false;
-            for (size_t j = 0; j < numNextStates; j++) {
-                if (nextStates[j] == start) {
-                    found = true;
-                    break;
-                }
-            }
-            
-            if (!found) {
-                if (numNextStates >= nextCapacity) {
-                    nextCapacity *= 2;
-                    nextStates = realloc(nextStates, nextCapacity * sizeof(struct State *));
-                    nextStartPositions = realloc(nextStartPositions, nextCapacity * sizeof(size_t));
-                }
-                nextStates[numNextStates] = start;
-                nextStartPositions[numNextStates] = pos + 1;
-                numNextStates++;
+        if (search) {
+            if (next->size == 0) {
+                lastRestart = pos + 1;
             }
+            addThread(prog, next, scratch->stack, start, pos + 1);
         }
         
-        free(currentStates);
-        free(startPositions);
-
-        // Compute epsilon closure of next states
-        epsilonClosure(&nextStates, &numNextStates, &nextCapacity, &nextStartPositions);
-
-        currentStates = nextStates;
-        startPositions = nextStartPositions;
-        numCurrentStates = numNextStates;
-        capacity = nextCapacity;
+        struct ThreadList *swap = current;
+        current = next;
+        next = swap;
         
-        if (numCurrentStates == 0) {
-            free(currentStates);
-            free(startPositions);
-            if (bestMatchStart != -1) {
-                if (matchLength) *matchLength = bestMatchLength;
-                return bestMatchStart;
-            }
-            if (matchLength) *matchLength = 0;
-            return -1;
+        if (current->size == 0) {
+            break;
         }
         
-        // Check for accepting states AFTER consuming the character
-        for (size_t i = 0; i < numCurrentStates; i++) {
-            if (currentStates[i]->accept) {
-                int matchStart = (int)startPositions[i];
-                int matchLen = (pos + 1) - startPositions[i];
-                
-                if (greedy) {
-                    // Greedy mode: continue to find longest match
-                    if (search) {
-                        // In search mode, lock onto the first match position we find
-                        if (firstMatchStart == -1) {
-                            firstMatchStart = matchStart;
-                            bestMatchStart = matchStart;
-                            bestMatchLength = matchLen;
-                        } else if (matchStart == firstMatchStart) {
-                            // Same start position, update if longer
-                            if (matchLen > bestMatchLength) {
-                                bestMatchLength = matchLen;
-                            }
-                        }
-                    } else {
-                        // Not in search mode, just track the longest match
-                        if (matchLen > bestMatchLength || bestMatchStart == -1) {
-                            bestMatchStart = matchStart;
-                            bestMatchLength = matchLen;
-                        }
-                    }
-                } else {
-                    // Non-greedy mode: return first match immediately
-                    if (matchLength) *matchLength = matchLen;
-                    free(currentStates);
-                    free(startPositions);
-                    return matchStart;
-                }
+        // Check for accepting states AFTER consuming the character, taking the
+        // earliest-starting one and among those the lowest pattern. Threads that
+        // started at this position have consumed nothing and are skipped, since
+        // empty matches are never reported.
+        bool accepted = false;
+        size_t threadStart = 0;
+        uint32_t pattern = 0;
+        for (size_t i = 0; i < current->size; i++) {
+            uint32_t state = current->dense[i];
+            size_t stateStart = current->starts[state];
+            if (accepted && stateStart > threadStart) {
+                break;
+            }
+            if (prog->accept[state] && stateStart <= pos && (!accepted || prog->pattern[state] < pattern)) {
+                accepted = true;
+                threadStart = stateStart;
+                pattern = prog->pattern[state];
+            }
+        }
+        if (!accepted) {
+            continue;
+        }
+        
+        size_t matchLen = (pos + 1) - threadStart;
+        if (greedy && search) {
+            // Greedy search: the match starts where the earliest-starting accepting
+            // thread started. Threads from even earlier positions may have taken over
+            // the states it passed through, so the longest match from there is found
+            // by running again anchored at that position.
+            if (!runNFA(prog, scratch, input + threadStart, length - threadStart, false, true, final,
+                        match, NULL)) {
+                if (resume) *resume = threadStart;
+                return false;
             }
+            match->start += threadStart;
+            return true;
+        } else if (greedy) {
+            // Not in search mode, just track the longest match
+            haveMatch = true;
+            best = (struct Match) { .start = threadStart, .length = matchLen, .pattern = pattern };
+        } else {
+            // Non-greedy mode: return first match immediately
+            *match = (struct Match) { .start = threadStart, .length = matchLen, .pattern = pattern };
+            return true;
         }
     }
     
     // Already checked all final states in the loop
-    free(currentStates);
-    free(startPositions);
+    bool exhausted = current->size == 0;
     
-    if (bestMatchStart != -1) {
-        if (matchLength) *matchLength = bestMatchLength;
-        return bestMatchStart;
+    if (haveMatch && (final || exhausted)) {
+        *match = best;
+        return true;
     }
     
-    if (matchLength) *matchLength = 0;
-    return -1;
+    *match = (struct Match) {0};
+    if (resume) *resume = search ? lastRestart : 0;
+    return false;
+}
+
+/*
+    Finds where the earliest match ending at the end of input starts, running the
+    reversed program backwards from there. This lets the DFA and the bit-parallel
+    engine scan forwards without tracking starts at all: once they have found an
+    end, only the bytes since their last restart need walking again. The threads
+    start in every accepting state, and a thread reaching the start of a pattern
+    has found a match of that pattern. The leftmost such position is taken, and
+    the lowest pattern matching from there.
+
+    input must end where a non-empty match ends.
+*/
+struct Match runReverse(const struct Program *prog, struct NFAScratch *scratch, const char *input, size_t length) {
+    const struct Program *reverse = prog->reverse;
+    struct ThreadList *current = &scratch->lists[0];
+    struct ThreadList *next = &scratch->lists[1];
+    current->size = 0;
+    for (uint32_t state = 0; state < prog->numStates; state++) {
+        if (prog->accept[state]) {
+            addThread(reverse, current, scratch->stack, state, 0);
+        }
+    }
+
+    STAT_ADD(runs[ENGINE_REVERSE], 1);
+
+    bool accepted = false;
+    struct Match match = {0};
+    for (size_t pos = length; pos > 0 && current->size > 0; pos--) {
+        STAT_ADD(bytes[ENGINE_REVERSE], 1);
+        stepThreads(reverse, scratch->stack, current, next, (unsigned char)input[pos - 1]);
+
+        struct ThreadList *swap = current;
+        current = next;
+        next = swap;
+
+        bool first = true;
+        for (size_t i = 0; i < current->size; i++) {
+            uint32_t state = current->dense[i];
+            if (reverse->accept[state] && (first || reverse->pattern[state] < match.pattern)) {
+                accepted = true;
+                first = false;
+                match = (struct Match) { .start = pos - 1, .length = length - (pos - 1),
+                                         .pattern = reverse->pattern[state] };
+            }
+        }
+    }
+    assert(accepted);
+    return match;
 }
 
 // --------------------------------------------------------------------------- // 
 // --------------------------------------------------------------------------- // 
 
 /*
-    Supported syntax:
-        .: wildcard (any single character)
-        ?: 0 or 1 of the previous character
-        *: 0 or more of the previous character
-        +: 1 or more of the previous character
-        () Groups
-        \: Escape next character (treat as literal)
+    Lazy DFA
+
+    DFA states are built on demand by subset construction over the NFA and cached
+    with a transition table over the program's byte classes, so once the cache is
+    warm each input byte costs two lookups: its class, then the next state.
+
+    A DFA state holds only the NFA states reached by consuming input (the start
+    state's closure is implicitly re-added at every position, as runNFA does in
+    search mode). An empty set therefore means no partial match is alive, and any
+    match must begin at or after that position: runDFA reports the last such
+    position before the first accepting state so runNFA can recover the exact match
+    from there.
+
+    The cache is capped at maxStates and flushed when full. If it keeps filling up
+    without covering much input the DFA gives up and runNFA takes over.
 */
-struct NFA constructNFA(char *pattern) {
-    size_t numStates = 1;
-    size_t maxStates = 16;
-    struct State *states = malloc(sizeof(struct State)*maxStates);
-    states[0] = newState(false);
-    
-    size_t *groupStack = malloc(sizeof(size_t) * 32);
+
+#define DFA_DEFAULT_CACHE_STATES 2048
+#define DFA_MIN_BYTES_PER_STATE 10
+
+struct DFAState {
+    bool accept;
+    uint32_t id;                // Index in dfa->states
+    size_t numNfaStates;
+    uint32_t *nfaStates;        // Sorted program state IDs, stored after next
+    struct DFAState *next[];    // Indexed by byte class
+};
+
+struct DFA {
+    const struct Program *prog;
+    struct DFAState **states;
+    size_t numStates;
+    size_t maxStates;
+    struct DFAState **table;    // Open-addressed hash set over states
+    size_t tableSize;
+    uint32_t *startClosure;     // Closure of the start state, re-added at every position
+    size_t numStartClosure;
+    uint32_t *scratch;
+    uint32_t *stack;
+    bool *inSet;
+    size_t generation;          // Bumped on every flush
+    size_t bytesSinceFlush;
+    bool failed;
+};
+
+enum DFAResult {
+    DFA_NO_MATCH,
+    DFA_MATCH,
+    DFA_GAVE_UP
+};
+
+// Adds the epsilon closure of every state marked in inSet and returns the marked
+// states in ascending order through dfa->scratch
+static size_t dfaCollectClosure(struct DFA *dfa, uint32_t *stack, size_t stackTop) {
+    const struct Program *prog = dfa->prog;
+    while (stackTop > 0 && prog->closures) {
+        uint32_t current = stack[--stackTop];
+        STAT_ADD(closureStates, prog->closureStart[current + 1] - prog->closureStart[current]);
+        for (uint32_t i = prog->closureStart[current] + 1; i < prog->closureStart[current + 1]; i++) {
+            dfa->inSet[prog->closures[i]] = true;
+        }
+    }
+    while (stackTop > 0) {
+        uint32_t current = stack[--stackTop];
+        STAT_ADD(closureStates, 1);
+        for (uint32_t e = prog->epsilonStart[current]; e < prog->epsilonStart[current + 1]; e++) {
+            uint32_t target = prog->epsilons[e];
+            if (!dfa->inSet[target]) {
+                dfa->inSet[target] = true;
+                stack[stackTop++] = target;
+            }
+        }
+    }
+
+    size_t count = 0;
+    for (uint32_t i = 0; i < prog->numStates; i++) {
+        if (dfa->inSet[i]) {
+            dfa->scratch[count++] = i;
+            dfa->inSet[i] = false;
+        }
+    }
+    return count;
+}
+
+static size_t hashStateSet(const uint32_t *set, size_t count) {
+    size_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < count; i++) {
+        h = (h ^ set[i]) * 1099511628211ULL;
+    }
+    return h ^ count;
+}
+
+static void dfaFlush(struct DFA *dfa) {
+    for (size_t i = 0; i < dfa->numStates; i++) {
+        free(dfa->states[i]);
+    }
+    dfa->numStates = 0;
+    memset(dfa->table, 0, dfa->tableSize * sizeof(struct DFAState *));
+}
+
+// Finds or creates the DFA state for the set in dfa->scratch. Returns NULL if the
+// cache had to be flushed too soon after the previous flush.
+static struct DFAState *dfaIntern(struct DFA *dfa, size_t count) {
+    size_t mask = dfa->tableSize - 1;
+    size_t slot = hashStateSet(dfa->scratch, count) & mask;
+    for (; dfa->table[slot]; slot = (slot + 1) & mask) {
+        struct DFAState *ds = dfa->table[slot];
+        if (ds->numNfaStates == count && memcmp(ds->nfaStates, dfa->scratch, count * sizeof(uint32_t)) == 0) {
+            return ds;
+        }
+    }
+
+    if (dfa->numStates == dfa->maxStates) {
+        if (dfa->bytesSinceFlush < DFA_MIN_BYTES_PER_STATE * dfa->maxStates) {
+            STAT_ADD(dfaGaveUp, 1);
+            dfa->failed = true;
+            return NULL;
+        }
+        STAT_ADD(dfaFlushes, 1);
+        dfaFlush(dfa);
+        dfa->generation++;
+        dfa->bytesSinceFlush = 0;
+        slot = hashStateSet(dfa->scratch, count) & mask;
+    }
+
+    size_t numClasses = dfa->prog->numByteClasses;
+    struct DFAState *ds = calloc(1, sizeof(struct DFAState) + numClasses * sizeof(struct DFAState *) +
+                                    count * sizeof(uint32_t));
+    ds->nfaStates = (uint32_t *)(ds->next + numClasses);
+    ds->numNfaStates = count;
+    ds->id = (uint32_t)dfa->numStates;
+    memcpy(ds->nfaStates, dfa->scratch, count * sizeof(uint32_t));
+    for (size_t i = 0; i < count; i++) {
+        if (dfa->prog->accept[ds->nfaStates[i]]) {
+            ds->accept = true;
+            break;
+        }
+    }
+    dfa->states[dfa->numStates++] = ds;
+    dfa->table[slot] = ds;
+    return ds;
+}
+
+// Computes the successor of ds on byte ch and caches the edge
+static struct DFAState *dfaStep(struct DFA *dfa, struct DFAState *ds, unsigned char ch) {
+    const struct Program *prog = dfa->prog;
+    uint32_t *stack = dfa->stack;
     size_t stackTop = 0;
-    bool lastWasGroup = false;
-    bool lastCharWasOperator = false;
-    
-    for (char *c = pattern; *c; c++) {
-        switch (*c) {
-            case '.': {
-                // Wildcard transition (accept any one character)
-                if (maxStates == numStates) {
-                    maxStates += 16;
-                    states = realloc(states, sizeof(struct State)*maxStates);
+
+    for (int part = 0; part < 2; part++) {
+        size_t count = part == 0 ? ds->numNfaStates : dfa->numStartClosure;
+        const uint32_t *set = part == 0 ? ds->nfaStates : dfa->startClosure;
+        for (size_t i = 0; i < count; i++) {
+            for (uint32_t e = prog->edgeStart[set[i]]; e < prog->edgeStart[set[i] + 1]; e++) {
+                uint32_t target = prog->edges[e].next;
+                if (!dfa->inSet[target] && byteSetHas(&prog->edges[e].chars, ch)) {
+                    dfa->inSet[target] = true;
+                    stack[stackTop++] = target;
                 }
-                states[numStates] = newState(false);
-                
-                struct Transition wildTr = newWildcardTransition(&states[numStates]);
-                addTransition(&states[numStates-1], wildTr);
-                
-                numStates++;
-                lastWasGroup = false;
-                lastCharWasOperator = false;
-                break;
-            }
-            case '(': {
-                // Push current state onto stack so we can encapsulate the entire group in a transition if needed
-                groupStack[stackTop++] = numStates - 1;
-                lastWasGroup = false;
-                lastCharWasOperator = false;
-                break;
-            }
-            case ')': {
-                // Mark that a group was just closed
-                lastWasGroup = true;
-                lastCharWasOperator = false;
-                break;
             }
-            case '?': {
-                assert(numStates > 1);
-                assert(!lastCharWasOperator);
-                lastCharWasOperator = true;
-                
-                if (lastWasGroup) {
-                    // Make the entire group optional
-                    size_t groupStart = groupStack[--stackTop];
-                    addTransition(&states[groupStart], newTransition("", &states[numStates-1]));
-                } else {
-                    // Make last character optional
-                    addTransition(&states[numStates-2], newTransition("", &states[numStates-1]));
-                }
-                lastWasGroup = false;
-                break;
+        }
+    }
+
+    size_t count = dfaCollectClosure(dfa, stack, stackTop);
+
+    // A flush frees ds, so only record the edge if ds survived
+    size_t generation = dfa->generation;
+    struct DFAState *next = dfaIntern(dfa, count);
+    if (next && dfa->generation == generation) {
+        ds->next[prog->byteClass[ch]] = next;
+    }
+    return next;
+}
+
+/*
+    The states of a DFA can be saved along with its program, so that a later run
+    starts with them cached instead of building them again. A snapshot is a list
+    of words: for each state the number of program states in its set followed by
+    the set, then for each state a successor index per byte class, NO_DFA_STATE
+    where the edge has not been built.
+*/
+
+#define NO_DFA_STATE UINT32_MAX
+
+// Returns the number of words in the snapshot, which is allocated into *words
+size_t dfaSnapshot(const struct DFA *dfa, uint32_t **words) {
+    size_t numClasses = dfa->prog->numByteClasses;
+    size_t numWords = dfa->numStates * (1 + numClasses);
+    for (size_t i = 0; i < dfa->numStates; i++) {
+        numWords += dfa->states[i]->numNfaStates;
+    }
+    uint32_t *w = *words = malloc(numWords * sizeof(uint32_t));
+    for (size_t i = 0; i < dfa->numStates; i++) {
+        const struct DFAState *ds = dfa->states[i];
+        *w++ = (uint32_t)ds->numNfaStates;
+        memcpy(w, ds->nfaStates, ds->numNfaStates * sizeof(uint32_t));
+        w += ds->numNfaStates;
+    }
+    for (size_t i = 0; i < dfa->numStates; i++) {
+        for (size_t c = 0; c < numClasses; c++) {
+            const struct DFAState *next = dfa->states[i]->next[c];
+            *w++ = next ? next->id : NO_DFA_STATE;
+        }
+    }
+    return numWords;
+}
+
+// Interns the states saved with the program, as many as the cache holds
+static void dfaPreload(struct DFA *dfa) {
+    const struct Program *prog = dfa->prog;
+    size_t count = prog->numDfaStates < dfa->maxStates ? prog->numDfaStates : dfa->maxStates;
+    struct DFAState **loaded = malloc(count * sizeof(struct DFAState *));
+    const uint32_t *w = prog->dfaStates;
+    for (size_t i = 0; i < prog->numDfaStates; i++) {
+        uint32_t size = *w++;
+        if (i < count) {
+            memcpy(dfa->scratch, w, size * sizeof(uint32_t));
+            loaded[i] = dfaIntern(dfa, size);
+        }
+        w += size;
+    }
+    size_t numClasses = prog->numByteClasses;
+    for (size_t i = 0; i < count; i++) {
+        for (size_t c = 0; c < numClasses; c++) {
+            uint32_t next = w[i * numClasses + c];
+            if (next < count) {
+                loaded[i]->next[c] = loaded[next];
+            }
+        }
+    }
+    free(loaded);
+}
+
+struct DFA *newDFA(const struct Program *prog, size_t maxStates) {
+    struct DFA *dfa = calloc(1, sizeof(struct DFA));
+    dfa->prog = prog;
+    dfa->maxStates = maxStates;
+    dfa->states = malloc(maxStates * sizeof(struct DFAState *));
+    dfa->tableSize = 16;
+    while (dfa->tableSize < maxStates * 2) {
+        dfa->tableSize *= 2;
+    }
+    dfa->table = calloc(dfa->tableSize, sizeof(struct DFAState *));
+    dfa->scratch = malloc(prog->numStates * sizeof(uint32_t));
+    dfa->stack = malloc(prog->numStates * sizeof(uint32_t));
+    dfa->inSet = calloc(prog->numStates, sizeof(bool));
+
+    dfa->inSet[0] = true;
+    dfa->stack[0] = 0;
+    dfa->numStartClosure = dfaCollectClosure(dfa, dfa->stack, 1);
+    dfa->startClosure = malloc(dfa->numStartClosure * sizeof(uint32_t));
+    memcpy(dfa->startClosure, dfa->scratch, dfa->numStartClosure * sizeof(uint32_t));
+    if (prog->numDfaStates > 0) {
+        dfaPreload(dfa);
+    }
+    return dfa;
+}
+
+void freeDFA(struct DFA *dfa) {
+    dfaFlush(dfa);
+    free(dfa->states);
+    free(dfa->table);
+    free(dfa->startClosure);
+    free(dfa->scratch);
+    free(dfa->stack);
+    free(dfa->inSet);
+    free(dfa);
+}
+
+/*
+    Scans the first length bytes of input for the earliest end of a non-empty
+    match. On DFA_MATCH, *end is set to that end and *restart to the last offset
+    at which no partial match was alive, so every match ending at *end starts at
+    or after *restart, and runNFA started there finds the same match as runNFA
+    started at input. On DFA_GAVE_UP the cache was thrashing and *restart is the
+    last such offset seen before giving up.
+*/
+enum DFAResult runDFA(struct DFA *dfa, const char *input, size_t length, size_t *restart, size_t *end) {
+    const struct Prefilter *prefilter = dfa->prog->prefilter.length > 0 ? &dfa->prog->prefilter : NULL;
+    const uint8_t *byteClass = dfa->prog->byteClass;
+    size_t count = 0;
+    struct DFAState *current = dfaIntern(dfa, count);
+    *restart = 0;
+    STAT_ADD(runs[ENGINE_DFA], 1);
+    if (!current) {
+        return DFA_GAVE_UP;
+    }
+
+    for (size_t pos = 0; pos < length; pos++) {
+        // With no partial match alive, jump to where the literal prefix occurs next
+        if (prefilter && current->numNfaStates == 0) {
+            size_t candidate = pos + findPrefix(prefilter, input + pos, length - pos);
+            STAT_ADD(prefilterSkipped, candidate - pos);
+            if (candidate == length) {
+                *restart = prefixResume(prefilter, pos, length);
+                return DFA_NO_MATCH;
+            }
+            pos = *restart = candidate;
+        }
+
+        unsigned char ch = (unsigned char)input[pos];
+        struct DFAState *next = current->next[byteClass[ch]];
+        if (!next) {
+            STAT_ADD(dfaMisses, 1);
+            next = dfaStep(dfa, current, ch);
+            if (!next) {
+                return DFA_GAVE_UP;
+            }
+        } else {
+            STAT_ADD(dfaHits, 1);
+        }
+        current = next;
+        dfa->bytesSinceFlush++;
+        STAT_ADD(bytes[ENGINE_DFA], 1);
+
+        if (current->numNfaStates == 0) {
+            *restart = pos + 1;
+        } else if (current->accept) {
+            *end = pos + 1;
+            return DFA_MATCH;
+        }
+    }
+    return DFA_NO_MATCH;
+}
+
+// --------------------------------------------------------------------------- // 
+// --------------------------------------------------------------------------- // 
+
+/*
+    Bit-parallel simulation
+
+    A program with at most 64 consuming edges is also run as a Glushkov (position)
+    automaton held in a single 64-bit word. Each position is a consuming edge, and
+    is active when the byte just read was consumed through that edge. Following
+    epsilon edges is folded into the tables built up front, so a step is:
+
+        D' = (follow(D) | first) & chars[byte]
+
+    where first holds the edges leaving the start state's closure and follow(D) is
+    the union of the edges leaving the closures of the states the edges in D lead
+    to. follow(D) is read from one table per byte of D, each of which gives the
+    union for all 256 values of that byte. A position is last if an accepting
+    state can be reached from its edge's target.
+
+    Like the lazy DFA it only finds where the earliest match ends and where the
+    last restart (no active position) was, and runReverse recovers the start.
+    Unlike the DFA it needs no warm-up, so it suits small inputs and short runs
+    where building DFA states would cost more than they save.
+*/
+
+#define GLUSHKOV_MAX_POSITIONS 64
+
+struct Glushkov {
+    uint64_t first;
+    uint64_t last;
+    uint64_t chars[256];        // Positions whose edge consumes each byte
+    uint32_t numChunks;         // Bytes of D in use
+    uint64_t (*follow)[256];    // Per byte of D, the union of follow sets for each value
+};
+
+// Sets the bits of the edges leaving the epsilon closure of state, and returns
+// whether the closure holds an accepting state
+static bool glushkovClosure(const struct Program *prog, uint32_t state, uint32_t *stack, uint32_t *seen,
+                            uint32_t mark, uint64_t *edges) {
+    bool accept = false;
+    size_t top = 0;
+    stack[top++] = state;
+    seen[state] = mark;
+    while (top > 0) {
+        uint32_t current = stack[--top];
+        accept = accept || prog->accept[current];
+        for (uint32_t e = prog->edgeStart[current]; e < prog->edgeStart[current + 1]; e++) {
+            *edges |= (uint64_t)1 << e;
+        }
+        for (uint32_t e = prog->epsilonStart[current]; e < prog->epsilonStart[current + 1]; e++) {
+            uint32_t target = prog->epsilons[e];
+            if (seen[target] != mark) {
+                seen[target] = mark;
+                stack[top++] = target;
+            }
+        }
+    }
+    return accept;
+}
+
+// Returns NULL if the program has too many edges, or counters
+struct Glushkov *compileGlushkov(const struct Program *prog) {
+    uint32_t numPositions = prog->edgeStart[prog->numStates];
+    if (numPositions > GLUSHKOV_MAX_POSITIONS || prog->numCounters > 0) {
+        return NULL;
+    }
+
+    struct Glushkov *g = calloc(1, sizeof(struct Glushkov));
+    g->numChunks = (numPositions + 7) / 8;
+    g->follow = calloc(g->numChunks > 0 ? g->numChunks : 1, sizeof(*g->follow));
+
+    uint32_t *stack = malloc(prog->numStates * sizeof(uint32_t));
+    uint32_t *seen = calloc(prog->numStates, sizeof(uint32_t));
+    uint32_t mark = 1;
+    glushkovClosure(prog, 0, stack, seen, mark++, &g->first);
+
+    // The follow set of every position on its own, in the 8 table entries with a
+    // single bit set
+    for (uint32_t state = 0; state < prog->numStates; state++) {
+        for (uint32_t e = prog->edgeStart[state]; e < prog->edgeStart[state + 1]; e++) {
+            const struct Edge *edge = &prog->edges[e];
+            uint64_t *follow = &g->follow[e / 8][1 << (e % 8)];
+            if (glushkovClosure(prog, edge->next, stack, seen, mark++, follow)) {
+                g->last |= (uint64_t)1 << e;
+            }
+            for (int ch = 0; ch < 256; ch++) {
+                if (byteSetHas(&edge->chars, (unsigned char)ch)) {
+                    g->chars[ch] |= (uint64_t)1 << e;
+                }
+            }
+        }
+    }
+    free(stack);
+    free(seen);
+
+    // Every other value is the union of its lowest bit's set and the rest
+    for (uint32_t chunk = 0; chunk < g->numChunks; chunk++) {
+        for (int value = 3; value < 256; value++) {
+            int low = value & -value;
+            if (value != low) {
+                g->follow[chunk][value] = g->follow[chunk][low] | g->follow[chunk][value & ~low];
+            }
+        }
+    }
+    return g;
+}
+
+void freeGlushkov(struct Glushkov *g) {
+    free(g->follow);
+    free(g);
+}
+
+// Same contract as runDFA, which it stands in for; it never gives up
+enum DFAResult runGlushkov(const struct Program *prog, const char *input, size_t length, size_t *restart,
+                           size_t *end) {
+    const struct Glushkov *g = prog->glushkov;
+    const uint64_t first = g->first, last = g->last;
+    const struct Prefilter *prefilter = prog->prefilter.length > 0 ? &prog->prefilter : NULL;
+    uint64_t active = 0;
+    *restart = 0;
+    STAT_ADD(runs[ENGINE_BIT_PARALLEL], 1);
+
+    for (size_t pos = 0; pos < length; pos++) {
+        // With no partial match alive, jump to where the literal prefix occurs next
+        if (prefilter && active == 0) {
+            size_t candidate = pos + findPrefix(prefilter, input + pos, length - pos);
+            STAT_ADD(prefilterSkipped, candidate - pos);
+            if (candidate == length) {
+                *restart = prefixResume(prefilter, pos, length);
+                return DFA_NO_MATCH;
+            }
+            pos = *restart = candidate;
+        }
+
+        STAT_ADD(bytes[ENGINE_BIT_PARALLEL], 1);
+        uint64_t reach = first;
+        for (uint64_t rest = active, (*follow)[256] = g->follow; rest != 0; rest >>= 8, follow++) {
+            reach |= (*follow)[rest & 0xff];
+        }
+        active = reach & g->chars[(unsigned char)input[pos]];
+
+        if (active == 0) {
+            *restart = pos + 1;
+        } else if (active & last) {
+            *end = pos + 1;
+            return DFA_MATCH;
+        }
+    }
+    return DFA_NO_MATCH;
+}
+
+// --------------------------------------------------------------------------- // 
+// --------------------------------------------------------------------------- // 
+
+/*
+    Counted repetition
+
+    A character or class counted more than REPEAT_UNROLL_MAX times compiles to a
+    counter state (see struct Counter), which steps every count it holds with a
+    shift of its bitmap rather than one state per count. Neither the DFA nor the
+    bit-parallel engine can hold counts, so a program with counters is scanned by
+    the threads of the NFA simulation instead, without tracking where they started.
+    As with the other two, runReverse then recovers the start.
+*/
+
+// Same contract as runDFA, which it stands in for; it never gives up
+enum DFAResult runCounters(const struct Program *prog, struct NFAScratch *scratch, const char *input, size_t length,
+                           size_t *restart, size_t *end) {
+    const struct Prefilter *prefilter = prog->prefilter.length > 0 ? &prog->prefilter : NULL;
+    struct ThreadList *current = &scratch->lists[0];
+    struct ThreadList *next = &scratch->lists[1];
+    current->size = 0;
+    *restart = 0;
+    STAT_ADD(runs[ENGINE_COUNTERS], 1);
+
+    for (size_t pos = 0; pos < length; pos++) {
+        // With no partial match alive, jump to where the literal prefix occurs next
+        if (prefilter && current->size == 0) {
+            size_t candidate = pos + findPrefix(prefilter, input + pos, length - pos);
+            STAT_ADD(prefilterSkipped, candidate - pos);
+            if (candidate == length) {
+                *restart = prefixResume(prefilter, pos, length);
+                return DFA_NO_MATCH;
+            }
+            pos = *restart = candidate;
+        }
+
+        // A match may start at every position
+        STAT_ADD(bytes[ENGINE_COUNTERS], 1);
+        addThread(prog, current, scratch->stack, 0, 0);
+        stepThreads(prog, scratch->stack, current, next, (unsigned char)input[pos]);
+        struct ThreadList *swap = current;
+        current = next;
+        next = swap;
+
+        if (current->size == 0) {
+            *restart = pos + 1;
+            continue;
+        }
+        for (size_t i = 0; i < current->size; i++) {
+            if (prog->accept[current->dense[i]]) {
+                *end = pos + 1;
+                return DFA_MATCH;
+            }
+        }
+    }
+    return DFA_NO_MATCH;
+}
+
+// --------------------------------------------------------------------------- // 
+// --------------------------------------------------------------------------- // 
+
+/*
+    Literal sets
+
+    When every pattern is a plain string, the patterns are matched with an
+    Aho-Corasick automaton instead. The literals are put into a trie, and each
+    node's missing edges are filled in by following failure links. The result is a
+    complete transition table: every input byte is one lookup, however many
+    patterns there are. Bytes that occur in no literal behave alike and share one
+    column of the table, so the table only has as many columns as there are
+    distinct bytes in the literals, plus one.
+
+    The node reached after a byte spells the longest suffix of the input that is
+    also a prefix of some literal. The first node with a literal among its suffixes
+    marks the earliest match end, and the longest such literal gives the earliest
+    start. Trie edges are the only ones that lead one level deeper, so the longest
+    literal at a given start can be found by walking from the root for as long as
+    each step increases the depth.
+*/
+
+#define NO_LITERAL UINT32_MAX
+
+struct LiteralSet {
+    uint8_t byteClass[256];     // Column of each byte in next
+    uint32_t numClasses;
+    uint32_t numNodes;
+    uint32_t *next;             // numClasses entries per node
+    uint32_t *depth;
+    uint32_t *literal;          // Lowest pattern spelling out the node, or NO_LITERAL
+    uint32_t *suffixLength;     // Longest literal the node ends with, 0 if none
+    uint32_t *suffixPattern;    // Lowest pattern spelling out that literal
+};
+
+// Whether the NFA matches exactly its literal prefix and nothing else
+static bool isLiteralNFA(const struct NFA *nfa) {
+    return nfa->prefilter.length == nfa->numStates - 1 &&
+           nfa->states[nfa->numStates - 1].numTransitions == 0;
+}
+
+struct LiteralSet *newLiteralSet(const struct NFA *nfas, size_t numPatterns) {
+    struct LiteralSet *set = calloc(1, sizeof(struct LiteralSet));
+    size_t maxNodes = 1;
+    for (size_t p = 0; p < numPatterns; p++) {
+        const struct Prefilter *lit = &nfas[p].prefilter;
+        for (size_t i = 0; i < lit->length; i++) {
+            set->byteClass[(unsigned char)lit->literal[i]] = 1;
+        }
+        maxNodes += lit->length;
+    }
+    set->numClasses = 1;
+    for (int b = 0; b < 256; b++) {
+        if (set->byteClass[b]) {
+            set->byteClass[b] = (uint8_t)set->numClasses++;
+        }
+    }
+
+    size_t nc = set->numClasses;
+    set->next = calloc(maxNodes * nc, sizeof(uint32_t));
+    set->depth = malloc(maxNodes * sizeof(uint32_t));
+    set->literal = malloc(maxNodes * sizeof(uint32_t));
+    set->suffixLength = malloc(maxNodes * sizeof(uint32_t));
+    set->suffixPattern = malloc(maxNodes * sizeof(uint32_t));
+    set->numNodes = 1;
+    set->depth[0] = 0;
+    set->literal[0] = NO_LITERAL;
+
+    // Build the trie. Node 0 is the root, which no edge leads back to yet, so a
+    // 0 entry means the edge is missing.
+    for (size_t p = 0; p < numPatterns; p++) {
+        const struct Prefilter *lit = &nfas[p].prefilter;
+        if (lit->length == 0) {
+            continue;   // Only matches the empty string
+        }
+        uint32_t node = 0;
+        for (size_t i = 0; i < lit->length; i++) {
+            uint32_t *edge = &set->next[node * nc + set->byteClass[(unsigned char)lit->literal[i]]];
+            if (*edge == 0) {
+                uint32_t child = set->numNodes++;
+                set->depth[child] = set->depth[node] + 1;
+                set->literal[child] = NO_LITERAL;
+                *edge = child;
+            }
+            node = *edge;
+        }
+        if (set->literal[node] == NO_LITERAL) {
+            set->literal[node] = (uint32_t)p;
+        }
+    }
+
+    // Fill in missing edges breadth first, so a node's failure target (which is
+    // shallower) is always complete before the node itself
+    uint32_t *fail = malloc(set->numNodes * sizeof(uint32_t));
+    uint32_t *queue = malloc(set->numNodes * sizeof(uint32_t));
+    size_t head = 0, tail = 0;
+    set->suffixLength[0] = 0;
+    set->suffixPattern[0] = NO_LITERAL;
+    for (size_t c = 0; c < nc; c++) {
+        uint32_t child = set->next[c];
+        if (child != 0) {
+            fail[child] = 0;
+            queue[tail++] = child;
+        }
+    }
+    while (head < tail) {
+        uint32_t node = queue[head++];
+        if (set->literal[node] != NO_LITERAL) {
+            set->suffixLength[node] = set->depth[node];
+            set->suffixPattern[node] = set->literal[node];
+        } else {
+            set->suffixLength[node] = set->suffixLength[fail[node]];
+            set->suffixPattern[node] = set->suffixPattern[fail[node]];
+        }
+        for (size_t c = 0; c < nc; c++) {
+            uint32_t *edge = &set->next[node * nc + c];
+            uint32_t fallback = set->next[fail[node] * nc + c];
+            if (*edge != 0) {
+                fail[*edge] = fallback;
+                queue[tail++] = *edge;
+            } else {
+                *edge = fallback;
+            }
+        }
+    }
+    free(fail);
+    free(queue);
+    return set;
+}
+
+void freeLiteralSet(struct LiteralSet *set) {
+    free(set->next);
+    free(set->depth);
+    free(set->literal);
+    free(set->suffixLength);
+    free(set->suffixPattern);
+    free(set);
+}
+
+// Searches the first length bytes of input like runNFA in search mode does
+static bool runLiteralSet(const struct LiteralSet *set, const char *input, size_t length, bool greedy, bool final,
+                          struct Match *match, size_t *resume) {
+    size_t nc = set->numClasses;
+    uint32_t node = 0;
+    STAT_ADD(runs[ENGINE_LITERALS], 1);
+    for (size_t pos = 0; pos < length; pos++) {
+        STAT_ADD(bytes[ENGINE_LITERALS], 1);
+        node = set->next[node * nc + set->byteClass[(unsigned char)input[pos]]];
+        if (set->suffixLength[node] == 0) {
+            continue;
+        }
+
+        match->start = pos + 1 - set->suffixLength[node];
+        match->length = set->suffixLength[node];
+        match->pattern = set->suffixPattern[node];
+        if (greedy) {
+            // Look for a longer literal starting at the same position
+            uint32_t walk = 0;
+            size_t end = match->start;
+            for (; end < length; end++) {
+                uint32_t child = set->next[walk * nc + set->byteClass[(unsigned char)input[end]]];
+                if (set->depth[child] != set->depth[walk] + 1) {
+                    break;
+                }
+                walk = child;
+                if (set->literal[walk] != NO_LITERAL) {
+                    match->length = end + 1 - match->start;
+                    match->pattern = set->literal[walk];
+                }
+            }
+            if (end == length && !final) {
+                *resume = match->start;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // A match may still begin with the bytes the automaton is in the middle of
+    *resume = length - set->depth[node];
+    return false;
+}
+
+// --------------------------------------------------------------------------- // 
+// --------------------------------------------------------------------------- // 
+
+/*
+    Match iterator
+
+    Reports all non-overlapping matches in a buffer in one forward pass. Each call
+    resumes at the end of the previous match, keeping the DFA cache warm across
+    calls. The DFA stops exactly at the end of a non-greedy match, so apart from
+    runNFA re-reading the match itself every byte is scanned once; greedy matches
+    additionally re-read whatever runNFA consumed looking for a longer match.
+
+    The input can also be fed in chunks. While the buffer is not final, a search
+    that runs into its end stops and moves offset up to the first byte a later
+    match could need. The caller then drops everything before offset, appends more
+    input and calls refillMatchIterator; the search resumes from there.
+*/
+
+struct MatchIterator {
+    const struct Program *prog;
+    struct DFA *dfa;        // May be NULL
+    struct NFAScratch *scratch;
+    const char *input;
+    size_t length;
+    size_t base;            // Position of input[0] within the whole stream
+    size_t offset;          // Where the next search starts, relative to input
+    bool final;             // No more input follows the buffer
+    bool greedy;
+};
+
+void initMatchIterator(struct MatchIterator *it, const struct Program *prog, struct DFA *dfa,
+                       struct NFAScratch *scratch, const char *input, size_t length, bool final, bool greedy) {
+    it->prog = prog;
+    it->dfa = dfa;
+    it->scratch = scratch;
+    it->input = input;
+    it->length = length;
+    it->base = 0;
+    it->offset = 0;
+    it->final = final;
+    it->greedy = greedy;
+}
+
+// Continues with a new buffer, whose first byte must be the byte that was at
+// it->offset in the previous one
+void refillMatchIterator(struct MatchIterator *it, const char *input, size_t length, bool final) {
+    it->base += it->offset;
+    it->input = input;
+    it->length = length;
+    it->offset = 0;
+    it->final = final;
+}
+
+// Finds the next match, filling in *match with its start as a position within the
+// whole stream. Returns false once the buffer is exhausted; unless the buffer was
+// final, more input may then yield further matches.
+bool nextMatch(struct MatchIterator *it, struct Match *match) {
+    if (it->offset >= it->length) {
+        return false;
+    }
+
+    size_t restart = it->offset;
+    size_t resume;
+    bool found;
+    if (it->prog->literals) {
+        found = runLiteralSet(it->prog->literals, it->input + restart, it->length - restart, it->greedy, it->final,
+                              match, &resume);
+    } else {
+        // Let runCounters, the bit-parallel engine or the DFA find where the
+        // earliest match ends
+        enum DFAResult result = DFA_GAVE_UP;
+        size_t skipped = 0, end = 0;
+        if (it->prog->numCounters > 0) {
+            result = runCounters(it->prog, it->scratch, it->input + it->offset, it->length - it->offset, &skipped,
+                                 &end);
+        } else if (it->prog->glushkov) {
+            result = runGlushkov(it->prog, it->input + it->offset, it->length - it->offset, &skipped, &end);
+        } else if (it->dfa && !it->dfa->failed) {
+            result = runDFA(it->dfa, it->input + it->offset, it->length - it->offset, &skipped, &end);
+        }
+        if (result == DFA_NO_MATCH) {
+            it->offset = it->final ? it->length : it->offset + skipped;
+            return false;
+        }
+        restart += skipped;
+
+        if (result == DFA_MATCH) {
+            // Walk back from the end for where the match starts. A greedy match is
+            // then the longest one from there, which may end later.
+            *match = runReverse(it->prog, it->scratch, it->input + restart, it->offset + end - restart);
+            found = true;
+            if (it->greedy) {
+                restart += match->start;
+                found = runNFA(it->prog, it->scratch, it->input + restart, it->length - restart, false, true,
+                               it->final, match, &resume);
+            }
+        } else {
+            found = runNFA(it->prog, it->scratch, it->input + restart, it->length - restart, true, it->greedy,
+                           it->final, match, &resume);
+        }
+    }
+
+    if (!found) {
+        it->offset = it->final ? it->length : restart + resume;
+        return false;
+    }
+
+    it->offset = restart + match->start + match->length;
+    match->start += it->base + restart;
+    return true;
+}
+
+/*
+    Line mode: finds the next line holding a match that lies within the line. The
+    iterator must be non-greedy, over a final buffer and at the start of a line.
+    Sets *line to the line without its newline and moves the iterator to the start
+    of the next line, so the rest of a matching line is never searched.
+
+    A match can still run over a newline the pattern spells out. It is then the
+    earliest-ending match from the line the search started on, so no line before
+    its last newline can hold a match of its own and the search resumes after it.
+
+    nextMatch never reports an empty match, so a pattern that matches the empty
+    string is handled apart: as in grep, it matches at the start of every line.
+*/
+bool nextMatchingLine(struct MatchIterator *it, struct Match *line) {
+    if (it->prog->emptyPattern < it->prog->numPatterns) {
+        if (it->offset >= it->length) {
+            return false;
+        }
+        const char *lineStart = it->input + it->offset;
+        const char *end = it->input + it->length;
+        const char *lineEnd = memchr(lineStart, '\n', (size_t)(end - lineStart));
+        lineEnd = lineEnd ? lineEnd : end;
+        it->offset = lineEnd < end ? (size_t)(lineEnd - it->input) + 1 : it->length;
+        line->start = it->base + (size_t)(lineStart - it->input);
+        line->length = (size_t)(lineEnd - lineStart);
+        line->pattern = it->prog->emptyPattern;
+        return true;
+    }
+
+    while (true) {
+        const char *from = it->input + it->offset;
+        struct Match m;
+        if (!nextMatch(it, &m)) {
+            return false;
+        }
+
+        const char *text = it->input + (m.start - it->base);
+        const char *end = it->input + it->length;
+        const char *newline = memrchr(text, '\n', m.length);
+        if (newline) {
+            it->offset = (size_t)(newline - it->input) + 1;
+            continue;
+        }
+
+        const char *lineStart = memrchr(from, '\n', (size_t)(text - from));
+        lineStart = lineStart ? lineStart + 1 : from;
+        const char *lineEnd = memchr(text + m.length, '\n', (size_t)(end - (text + m.length)));
+        lineEnd = lineEnd ? lineEnd : end;
+        it->offset = lineEnd < end ? (size_t)(lineEnd - it->input) + 1 : it->length;
+
+        line->start = it->base + (size_t)(lineStart - it->input);
+        line->length = (size_t)(lineEnd - lineStart);
+        line->pattern = m.pattern;
+        return true;
+    }
+}
+
+// Counts the newlines in text[0, length)
+size_t countNewlines(const char *text, size_t length) {
+    size_t count = 0;
+    size_t i = 0;
+#ifdef __SSE2__
+    // Each compare adds one to the byte lanes that hit; the lanes are summed
+    // before they can overflow
+    const __m128i newline = _mm_set1_epi8('\n');
+    while (length - i >= 16) {
+        size_t blocks = (length - i) / 16 < 255 ? (length - i) / 16 : 255;
+        __m128i hits = _mm_setzero_si128();
+        for (size_t b = 0; b < blocks; b++, i += 16) {
+            __m128i block = _mm_loadu_si128((const __m128i *)(text + i));
+            hits = _mm_sub_epi8(hits, _mm_cmpeq_epi8(block, newline));
+        }
+        __m128i sums = _mm_sad_epu8(hits, _mm_setzero_si128());
+        count += (size_t)_mm_cvtsi128_si32(sums) + (size_t)_mm_extract_epi16(sums, 4);
+    }
+#endif
+    for (; i < length; i++) {
+        count += text[i] == '\n';
+    }
+    return count;
+}
+
+// --------------------------------------------------------------------------- // 
+// --------------------------------------------------------------------------- // 
+
+void freeNFA(struct NFA *nfa) {
+    for (size_t i = 0; i < nfa->numStates; i++) {
+        free(nfa->states[i].transitions);
+    }
+    free(nfa->states);
+    free(nfa->prefilter.literal);
+}
+
+/*
+    Parses the bracket class whose '[' class points at, adding its bytes to
+    *chars. A ']' right after the '[' or '[^' is a member, as is a '-' at either
+    end, and a backslash makes the next character a member. Returns a pointer to
+    the closing ']', or NULL with *error set if the class is malformed.
+*/
+static const char *parseClass(const char *class, bool caseless, struct ByteSet *chars, bool *negated,
+                              const char **error) {
+    const char *c = class + 1;
+    *negated = *c == '^';
+    if (*negated) {
+        c++;
+    }
+    for (const char *first = c; *c && (*c != ']' || c == first); c++) {
+        unsigned char lo = (unsigned char)*c;
+        if (lo == '\\' && c[1]) {
+            lo = (unsigned char)*++c;
+        }
+        unsigned char hi = lo;
+        if (c[1] == '-' && c[2] && c[2] != ']') {
+            c += 2;
+            hi = (unsigned char)*c;
+            if (hi == '\\' && c[1]) {
+                hi = (unsigned char)*++c;
+            }
+            if (hi < lo) {
+                *error = "range out of order in '[...]'";
+                return NULL;
+            }
+        }
+        for (unsigned ch = lo; ch <= hi; ch++) {
+            byteSetAddCase(chars, (unsigned char)ch, caseless);
+        }
+    }
+    if (!*c) {
+        *error = "missing ']'";
+        return NULL;
+    }
+    if (*negated) {
+        for (int i = 0; i < 4; i++) {
+            chars->bits[i] = ~chars->bits[i];
+        }
+    }
+    return c;
+}
+
+#define REPEAT_MAX 32767                // Largest count '{' takes, as RE_DUP_MAX
+#define REPEAT_UNROLL_MAX 64            // Larger counts of one character or class run on a counter
+#define REPEAT_MAX_STATES (1 << 16)     // Unrolled groups may not grow an NFA past this
+/*
+    Parses the interval whose '{' brace points at: {n}, {n,} or {n,m}. Returns a
+    pointer to the closing '}', or NULL if brace does not start an interval, in
+    which case it is an ordinary character. A count too large for REPEAT_MAX comes
+    back as REPEAT_MAX + 1.
+*/
+static const char *parseInterval(const char *brace, uint32_t *min, uint32_t *max) {
+    const char *c = brace + 1;
+    if (*c < '0' || *c > '9') {
+        return NULL;
+    }
+    uint32_t counts[2] = {0, 0};
+    for (int i = 0; i < 2; i++) {
+        for (; *c >= '0' && *c <= '9'; c++) {
+            counts[i] = counts[i] * 10 + (uint32_t)(*c - '0');
+            if (counts[i] > REPEAT_MAX) {
+                counts[i] = REPEAT_MAX + 1;
+            }
+        }
+        if (i == 0 && *c == '}') {
+            *min = *max = counts[0];
+            return c;
+        }
+        if (i == 0 && *c++ != ',') {
+            return NULL;
+        }
+        if (i == 1 && *c == '}') {
+            *min = counts[0];
+            *max = c[-1] == ',' ? COUNTER_UNBOUNDED : counts[1];
+            return c;
+        }
+    }
+    return NULL;
+}
+
+// Appends a state with no transitions and returns its index, growing the array
+// as needed
+static size_t appendState(struct State **states, size_t *numStates, size_t *capacity) {
+    if (*numStates == *capacity) {
+        *capacity *= 2;
+        STAT_ADD(reallocs, 1);
+        *states = realloc(*states, *capacity * sizeof(struct State));
+    }
+    (*states)[*numStates] = newState(false);
+    return (*numStates)++;
+}
+
+/*
+    Unrolls the last atom of the NFA, which runs from state atomStart to the last
+    state, into min to max copies. Each copy starts where the one before it ends,
+    and copies beyond the first min may be skipped straight to the end. For {n,}
+    the last copy repeats, as for '+': a group's end leads back to the start of
+    its copy, and a character loops on its end.
+*/
+static void repeatAtom(struct State **states, size_t *numStates, size_t *capacity, size_t atomStart, bool group,
+                       uint32_t min, uint32_t max) {
+    size_t length = *numStates - 1 - atomStart;
+    if (max == 0) {
+        for (size_t i = atomStart; i < *numStates; i++) {
+            free((*states)[i].transitions);
+        }
+        (*states)[atomStart] = newState(false);
+        *numStates = atomStart + 1;
+        return;
+    }
+    if (length == 0) {
+        // An empty group
+        return;
+    }
+
+    // The atom's transitions, before any copy adds to its end state
+    struct State *atom = malloc((length + 1) * sizeof(struct State));
+    for (size_t i = 0; i <= length; i++) {
+        const struct State *st = &(*states)[atomStart + i];
+        atom[i] = newState(false);
+        for (size_t tr = 0; tr < st->numTransitions; tr++) {
+            addTransition(&atom[i], st->transitions[tr]);
+        }
+    }
+
+    size_t copies = max != COUNTER_UNBOUNDED ? max : min > 0 ? min : 1;
+    for (size_t copy = 1; copy < copies; copy++) {
+        size_t offset = copy * length;
+        for (size_t i = 0; i <= length; i++) {
+            size_t state = i == 0 ? atomStart + offset : appendState(states, numStates, capacity);
+            for (size_t tr = 0; tr < atom[i].numTransitions; tr++) {
+                struct Transition t = atom[i].transitions[tr];
+                t.next += offset;
+                addTransition(&(*states)[state], t);
+            }
+        }
+    }
+
+    size_t last = *numStates - 1;
+    if (max != COUNTER_UNBOUNDED) {
+        // Skipping leads to the last end, which has no transitions of its own
+        for (size_t copy = min; copy < copies; copy++) {
+            addTransition(&(*states)[atomStart + copy * length], newEpsilonTransition(last));
+        }
+    } else {
+        size_t lastStart = atomStart + (copies - 1) * length;
+        if (group) {
+            addTransition(&(*states)[last], newEpsilonTransition(lastStart));
+        } else {
+            struct Transition loop = atom[0].transitions[0];
+            loop.next = last;
+            addTransition(&(*states)[last], loop);
+        }
+        // The end now loops, so what follows starts from a new one
+        size_t end = appendState(states, numStates, capacity);
+        addTransition(&(*states)[last], newEpsilonTransition(end));
+        if (min == 0) {
+            addTransition(&(*states)[atomStart], newEpsilonTransition(end));
+        }
+    }
+
+    for (size_t i = 0; i <= length; i++) {
+        free(atom[i].transitions);
+    }
+    free(atom);
+}
+
+/*
+    Supported syntax:
+        .: wildcard (any single character)
+        [abc], [a-z]: any one character in the class
+        [^abc]: any one character not in the class
+        ?: 0 or 1 of the previous character
+        *: 0 or more of the previous character
+        +: 1 or more of the previous character
+        {n}, {n,}, {n,m}: n, at least n, or n to m of the previous character
+        () Groups
+        \: Escape next character (treat as literal)
+
+    If caseless is set, letters match in either case.
+
+    A counted character or class is unrolled into a chain of states if there are
+    at most REPEAT_UNROLL_MAX of it, so that the DFA and the bit-parallel engine
+    can run it. Past that its transition is left counted, and compileNFA gives it
+    a counter instead. Groups are always unrolled.
+*/
+struct NFA constructNFA(const char *pattern, bool caseless) {
+    size_t numStates = 1;
+    size_t capacity = strlen(pattern) + 1;
+    struct State *states = malloc(sizeof(struct State) * capacity);
+    states[0] = newState(false);
+    
+    // Each open group's start state
+    size_t *groupStack = malloc(sizeof(size_t) * (strlen(pattern) + 1));
+    size_t stackTop = 0;
+    const char *error = NULL;
+    bool lastWasGroup = false;
+    bool canRepeat = false;     // Whether a character or group has just ended
+    
+    // The last character or group runs from atomStart to the last state
+    size_t atomStart = 0;
+    
+    for (const char *c = pattern; *c && !error; c++) {
+        // The set of characters the next state is reached by
+        struct ByteSet chars = {{0}};
+        bool negated = false;
+        uint32_t min, max;
+        const char *interval = *c == '{' ? parseInterval(c, &min, &max) : NULL;
+        
+        if (interval) {
+            if (!canRepeat) {
+                error = "'{' does not follow a character or group";
+                continue;
+            }
+            if (min > REPEAT_MAX || (max != COUNTER_UNBOUNDED && max > REPEAT_MAX)) {
+                error = "count too large in '{...}'";
+                continue;
+            }
+            if (max < min) {
+                error = "counts out of order in '{...}'";
+                continue;
+            }
+            canRepeat = false;
+            c = interval;
+            
+            size_t copies = max != COUNTER_UNBOUNDED ? max : min;
+            size_t length = numStates - 1 - atomStart;
+            if (!lastWasGroup && copies > REPEAT_UNROLL_MAX) {
+                // Count the character on its transition rather than in states
+                states[atomStart].transitions[0].min = min;
+                states[atomStart].transitions[0].max = max;
+            } else if (numStates + copies * length > REPEAT_MAX_STATES) {
+                error = "'{...}' repeats a group too often";
+            } else {
+                repeatAtom(&states, &numStates, &capacity, atomStart, lastWasGroup, min, max);
+            }
+            lastWasGroup = false;
+            continue;
+        }
+        
+        switch (*c) {
+            case '.': {
+                // Wildcard transition (accept any one character)
+                memset(&chars, 0xff, sizeof(chars));
+                negated = true;
+                break;
+            }
+            case '[': {
+                c = parseClass(c, caseless, &chars, &negated, &error);
+                break;
+            }
+            case '(': {
+                // A group that opens where another one does gets a start state of
+                // its own, so that the epsilon edges an operator adds to either
+                // start cannot be taken from inside the other group
+                if (stackTop > 0 && groupStack[stackTop - 1] == numStates - 1) {
+                    size_t start = appendState(&states, &numStates, &capacity);
+                    addTransition(&states[start - 1], newEpsilonTransition(start));
+                }
+                groupStack[stackTop++] = numStates - 1;
+                lastWasGroup = false;
+                canRepeat = false;
+                continue;
+            }
+            case ')': {
+                if (stackTop == 0) {
+                    error = "unmatched ')'";
+                    continue;
+                }
+                // The group just closed is what an operator applies to
+                atomStart = groupStack[--stackTop];
+                lastWasGroup = true;
+                canRepeat = true;
+                continue;
+            }
+            case '?':
+            case '*':
+            case '+': {
+                if (!canRepeat) {
+                    error = *c == '?' ? "'?' does not follow a character or group"
+                          : *c == '*' ? "'*' does not follow a character or group"
+                          : "'+' does not follow a character or group";
+                    continue;
+                }
+                canRepeat = false;
+                
+                // Every character or group ends in a state with no transitions,
+                // which the next one starts from. An operator that loops keeps
+                // that true by leading on to a new end (Thompson's construction),
+                // so nothing that follows is repeated along with the loop and
+                // skipping to the end never lands inside one.
+                size_t end = numStates - 1;
+                if (*c == '?') {
+                    addTransition(&states[atomStart], newEpsilonTransition(end));
+                } else if (!lastWasGroup && *c == '*' &&
+                           (stackTop == 0 || groupStack[stackTop - 1] != atomStart)) {
+                    // Loop on the state before the character, which no group
+                    // starts at and which nothing else leaves from
+                    states[atomStart].transitions[0].next = atomStart;
+                    addTransition(&states[atomStart], newEpsilonTransition(end));
+                } else {
+                    if (lastWasGroup) {
+                        addTransition(&states[end], newEpsilonTransition(atomStart));
+                    } else {
+                        struct Transition loop = states[atomStart].transitions[0];
+                        addTransition(&states[end], loop);
+                    }
+                    size_t next = appendState(&states, &numStates, &capacity);
+                    addTransition(&states[end], newEpsilonTransition(next));
+                    if (*c == '*') {
+                        addTransition(&states[atomStart], newEpsilonTransition(next));
+                    }
+                }
+                lastWasGroup = false;
+                continue;
+            }
+            case '\\': {
+                // Backslash at end of pattern - treat as literal backslash
+                if (c[1]) {
+                    c++;
+                }
+                // fallthrough to literal character case (for operator characters)
+                __attribute__((fallthrough));
+            }
+            default: {
+                byteSetAddCase(&chars, (unsigned char)*c, caseless);
+                break;
+            }
+        }
+        if (error) {
+            break;
+        }
+        
+        // Create transition on these characters to new state
+        atomStart = numStates - 1;
+        size_t next = appendState(&states, &numStates, &capacity);
+        addTransition(&states[atomStart], newTransition(&chars, negated, next));
+        lastWasGroup = false;
+        canRepeat = true;
+    }
+    
+    if (!error && stackTop > 0) {
+        error = "unmatched '('";
+    }
+    free(groupStack);
+    if (error) {
+        struct NFA invalid = { .states = states, .numStates = numStates };
+        freeNFA(&invalid);
+        return (struct NFA) { .error = error };
+    }
+    states[numStates-1].accept = true;
+    return (struct NFA) {
+        .numStates = numStates,
+        .states = states,
+        .prefilter = findLiteralPrefix(states, numStates)
+    };
+}
+
+// --------------------------------------------------------------------------- // 
+// --------------------------------------------------------------------------- // 
+
+/*
+    The NFA built by constructNFA is a web of separately allocated states,
+    transitions and character strings, convenient to build but slow to walk.
+    compileNFA flattens it into one allocation laid out for the matchers: states
+    are numbered, consuming and epsilon edges sit in separate contiguous arrays,
+    and each consuming edge tests a byte with a single bitmap lookup.
+
+    Several NFAs compile into one program that matches any of them. A new start
+    state leads to each NFA's start state through an epsilon edge, and every state
+    remembers which pattern it came from, so an accepting state says which pattern
+    matched. A program is released with freeProgram.
+
+    A program compiled for lines has wildcards that do not match a newline, so
+    that no match runs over the end of a line unless the pattern spells out the
+    newline itself.
+*/
+
+// Rounds size up so that whatever is carved out of the arena next stays aligned
+static size_t arenaAlign(size_t size) {
+    return (size + 7) & ~(size_t)7;
+}
+
+// Allocates a program and its arrays in one block, with room after them for a
+// prefilter literal of literalLength bytes
+static struct Program *newProgram(size_t numStates, size_t numEdges, size_t numEpsilons, size_t numCounters,
+                                  size_t literalLength) {
+    size_t size = arenaAlign(sizeof(struct Program));
+    size_t edgesAt = size;
+    size += arenaAlign(numEdges * sizeof(struct Edge));
+    size_t countersAt = size;
+    size += arenaAlign(numCounters * sizeof(struct Counter));
+    size_t edgeStartAt = size;
+    size += arenaAlign((numStates + 1) * sizeof(uint32_t));
+    size_t epsilonStartAt = size;
+    size += arenaAlign((numStates + 1) * sizeof(uint32_t));
+    size_t epsilonsAt = size;
+    size += arenaAlign(numEpsilons * sizeof(uint32_t));
+    size_t patternAt = size;
+    size += arenaAlign(numStates * sizeof(uint32_t));
+    size_t acceptAt = size;
+    size += arenaAlign(numStates * sizeof(bool));
+    size_t literalAt = size;
+    size += literalLength;
+
+    char *arena = calloc(1, size);
+    struct Program *prog = (struct Program *)arena;
+    prog->numStates = (uint32_t)numStates;
+    prog->edges = (struct Edge *)(arena + edgesAt);
+    prog->counters = (struct Counter *)(arena + countersAt);
+    prog->numCounters = (uint32_t)numCounters;
+    prog->firstCounter = (uint32_t)(numStates - numCounters);
+    prog->edgeStart = (uint32_t *)(arena + edgeStartAt);
+    prog->epsilonStart = (uint32_t *)(arena + epsilonStartAt);
+    prog->epsilons = (uint32_t *)(arena + epsilonsAt);
+    prog->pattern = (uint32_t *)(arena + patternAt);
+    prog->accept = (bool *)(arena + acceptAt);
+    prog->prefilter.literal = arena + literalAt;
+    return prog;
+}
+
+// Closure lists may hold this many states per program state on average; a program
+// whose closures would take more keeps following epsilon edges at match time
+#define CLOSURE_BUDGET 32
+
+/*
+    Lists each state's epsilon closure flat, so that addThread and the DFA enter a
+    closure in one pass rather than searching the epsilon edges again at every
+    byte. A closure holds the state itself first, then every state reachable from
+    it through epsilon edges or by leaving a counter with no minimum. The lists
+    are allocated apart from the arena, since how much they take is only known
+    once they are built; when they would run past CLOSURE_BUDGET they are dropped.
+*/
+static void computeClosures(struct Program *prog) {
+    uint32_t numStates = prog->numStates;
+    size_t budget = (size_t)CLOSURE_BUDGET * numStates, capacity = 2 * (size_t)numStates + 8;
+    uint32_t *closureStart = malloc((numStates + 1) * sizeof(uint32_t));
+    uint32_t *closures = malloc(capacity * sizeof(uint32_t));
+    uint32_t *stack = malloc(numStates * sizeof(uint32_t));
+    uint32_t *seen = calloc(numStates, sizeof(uint32_t));
+    size_t count = 0;
+    for (uint32_t state = 0; state < numStates && count <= budget; state++) {
+        closureStart[state] = (uint32_t)count;
+        size_t top = 0;
+        stack[top++] = state;
+        seen[state] = state + 1;
+        while (top > 0 && count <= budget) {
+            uint32_t current = stack[--top];
+            if (count == capacity) {
+                capacity *= 2;
+                closures = realloc(closures, capacity * sizeof(uint32_t));
+            }
+            closures[count++] = current;
+            if (current >= prog->firstCounter) {
+                const struct Counter *counter = &prog->counters[current - prog->firstCounter];
+                if (counter->min == 0 && seen[counter->exit] != state + 1) {
+                    seen[counter->exit] = state + 1;
+                    stack[top++] = counter->exit;
+                }
+                continue;
+            }
+            for (uint32_t e = prog->epsilonStart[current]; e < prog->epsilonStart[current + 1]; e++) {
+                uint32_t target = prog->epsilons[e];
+                if (seen[target] != state + 1) {
+                    seen[target] = state + 1;
+                    stack[top++] = target;
+                }
+            }
+        }
+    }
+    closureStart[numStates] = (uint32_t)count;
+    free(stack);
+    free(seen);
+    if (count > budget) {
+        free(closureStart);
+        free(closures);
+        return;
+    }
+    prog->closureStart = closureStart;
+    prog->closures = closures;
+}
+
+// Returns the lowest-numbered pattern whose accepting state can be reached from the
+// start state through epsilon edges alone, or numPatterns if there is none
+static uint32_t findEmptyPattern(const struct Program *prog) {
+    bool *visited = calloc(prog->numStates, sizeof(bool));
+    uint32_t *stack = malloc(prog->numStates * sizeof(uint32_t));
+    uint32_t found = prog->numPatterns;
+    size_t top = 0;
+    visited[0] = true;
+    stack[top++] = 0;
+    while (top > 0) {
+        uint32_t state = stack[--top];
+        if (prog->accept[state] && prog->pattern[state] < found) {
+            found = prog->pattern[state];
+        }
+        if (state >= prog->firstCounter) {
+            uint32_t exit = prog->counters[state - prog->firstCounter].exit;
+            if (prog->counters[state - prog->firstCounter].min == 0 && !visited[exit]) {
+                visited[exit] = true;
+                stack[top++] = exit;
+            }
+            continue;
+        }
+        for (uint32_t e = prog->epsilonStart[state]; e < prog->epsilonStart[state + 1]; e++) {
+            uint32_t target = prog->epsilons[e];
+            if (!visited[target]) {
+                visited[target] = true;
+                stack[top++] = target;
+            }
+        }
+    }
+    free(visited);
+    free(stack);
+    return found;
+}
+
+/*
+    Builds the program runReverse walks backwards: the same states, with every
+    consuming and epsilon edge turned around. A state accepts if a pattern starts
+    there, which is the start state for a single pattern or each target of the
+    start state's epsilon edges for several. A counter is turned around by
+    swapping its entry and exit: the epsilon edge into it now leaves from its old
+    exit, and its old entry is where it leads once done counting.
+*/
+static struct Program *reverseProgram(const struct Program *prog) {
+    uint32_t numStates = prog->numStates;
+    uint32_t numEdges = prog->edgeStart[numStates];
+    uint32_t numEpsilons = prog->epsilonStart[numStates];
+    struct Program *reverse = newProgram(numStates, numEdges, numEpsilons, prog->numCounters, 0);
+    reverse->numPatterns = prog->numPatterns;
+    reverse->numCountWords = prog->numCountWords;
+    for (uint32_t k = 0; k < prog->numCounters; k++) {
+        reverse->counters[k] = prog->counters[k];
+        reverse->counters[k].entry = prog->counters[k].exit;
+        reverse->counters[k].exit = prog->counters[k].entry;
+        reverse->epsilonStart[prog->counters[k].exit + 1]++;
+    }
+    memcpy(reverse->byteClass, prog->byteClass, sizeof(prog->byteClass));
+    reverse->numByteClasses = prog->numByteClasses;
+    memcpy(reverse->pattern, prog->pattern, numStates * sizeof(uint32_t));
+
+    // Count the edges into each state, then place each one after those before it
+    for (uint32_t state = 0; state < numStates; state++) {
+        for (uint32_t e = prog->edgeStart[state]; e < prog->edgeStart[state + 1]; e++) {
+            reverse->edgeStart[prog->edges[e].next + 1]++;
+        }
+        for (uint32_t e = prog->epsilonStart[state]; e < prog->epsilonStart[state + 1]; e++) {
+            if (prog->epsilons[e] < prog->firstCounter) {
+                reverse->epsilonStart[prog->epsilons[e] + 1]++;
+            }
+        }
+    }
+    for (uint32_t state = 0; state < numStates; state++) {
+        reverse->edgeStart[state + 1] += reverse->edgeStart[state];
+        reverse->epsilonStart[state + 1] += reverse->epsilonStart[state];
+    }
+    uint32_t *edgeFill = malloc((numStates + 1) * sizeof(uint32_t));
+    uint32_t *epsilonFill = malloc((numStates + 1) * sizeof(uint32_t));
+    memcpy(edgeFill, reverse->edgeStart, (numStates + 1) * sizeof(uint32_t));
+    memcpy(epsilonFill, reverse->epsilonStart, (numStates + 1) * sizeof(uint32_t));
+    for (uint32_t state = 0; state < numStates; state++) {
+        for (uint32_t e = prog->edgeStart[state]; e < prog->edgeStart[state + 1]; e++) {
+            struct Edge *edge = &reverse->edges[edgeFill[prog->edges[e].next]++];
+            edge->chars = prog->edges[e].chars;
+            edge->next = state;
+        }
+        for (uint32_t e = prog->epsilonStart[state]; e < prog->epsilonStart[state + 1]; e++) {
+            if (prog->epsilons[e] < prog->firstCounter) {
+                reverse->epsilons[epsilonFill[prog->epsilons[e]]++] = state;
+            }
+        }
+    }
+    for (uint32_t k = 0; k < prog->numCounters; k++) {
+        reverse->epsilons[epsilonFill[prog->counters[k].exit]++] = prog->firstCounter + k;
+    }
+    free(edgeFill);
+    free(epsilonFill);
+
+    if (prog->numPatterns > 1) {
+        for (uint32_t e = prog->epsilonStart[0]; e < prog->epsilonStart[1]; e++) {
+            reverse->accept[prog->epsilons[e]] = true;
+        }
+    } else {
+        reverse->accept[0] = true;
+    }
+    computeClosures(reverse);
+    return reverse;
+}
+
+/*
+    Splits the bytes into classes that no edge tells apart: two bytes share a class
+    if every edge consumes both or neither. The DFA keeps a transition per class
+    rather than per byte, which for most patterns is a handful of columns instead
+    of 256.
+*/
+static void computeByteClasses(struct Program *prog) {
+    memset(prog->byteClass, 0, sizeof(prog->byteClass));
+    uint32_t numClasses = 1;
+    for (uint32_t e = 0; e < prog->edgeStart[prog->numStates] && numClasses < 256; e++) {
+        // Give each class a new number for its bytes in the edge and another for
+        // those outside it
+        int16_t split[256][2];
+        memset(split, -1, sizeof(split));
+        uint32_t count = 0;
+        for (int ch = 0; ch < 256; ch++) {
+            int16_t *to = &split[prog->byteClass[ch]][byteSetHas(&prog->edges[e].chars, (unsigned char)ch)];
+            if (*to < 0) {
+                *to = (int16_t)count++;
+            }
+            prog->byteClass[ch] = (uint8_t)*to;
+        }
+        numClasses = count;
+    }
+    prog->numByteClasses = numClasses;
+}
+
+// Removes the newline from a wildcard or negated class in a program for lines
+static void lineChars(struct ByteSet *chars, bool lines, bool negated) {
+    if (lines && negated) {
+        chars->bits['\n' >> 6] &= ~((uint64_t)1 << ('\n' & 63));
+    }
+}
+
+struct Program *compileNFA(struct NFA *nfas, size_t numPatterns, bool lines) {
+    size_t numStates = numPatterns > 1 ? 1 : 0;
+    size_t numEdges = 0;
+    size_t numEpsilons = numPatterns > 1 ? numPatterns : 0;
+    size_t numCounters = 0;
+    bool allLiterals = numPatterns > 1;
+    for (size_t p = 0; p < numPatterns; p++) {
+        struct NFA *nfa = &nfas[p];
+        numStates += nfa->numStates;
+        allLiterals = allLiterals && isLiteralNFA(nfa);
+        for (size_t i = 0; i < nfa->numStates; i++) {
+            for (size_t tr = 0; tr < nfa->states[i].numTransitions; tr++) {
+                const struct Transition *t = &nfa->states[i].transitions[tr];
+                if (t->epsilon) {
+                    numEpsilons++;
+                } else if (t->max != 1) {
+                    // An epsilon edge into a counter state of its own
+                    numEpsilons++;
+                    numCounters++;
+                } else {
+                    numEdges++;
+                }
+            }
+        }
+    }
+    numStates += numCounters;
+
+    // Only a single pattern has a literal prefix every match starts with
+    struct Prefilter prefilter = {0};
+    if (numPatterns == 1) {
+        prefilter = nfas[0].prefilter;
+    }
+
+    struct Program *prog = newProgram(numStates, numEdges, numEpsilons, numCounters, prefilter.length);
+    prog->numPatterns = (uint32_t)numPatterns;
+    char *literal = prog->prefilter.literal;
+    prog->prefilter = prefilter;
+    prog->prefilter.literal = literal;
+    if (prefilter.length > 0) {
+        memcpy(prog->prefilter.literal, prefilter.literal, prefilter.length);
+    }
+    prog->literals = allLiterals ? newLiteralSet(nfas, numPatterns) : NULL;
+
+    uint32_t state = 0;
+    uint32_t edge = 0;
+    uint32_t epsilon = 0;
+    uint32_t counter = 0;
+    if (numPatterns > 1) {
+        // Start state leading into every pattern
+        prog->edgeStart[state] = edge;
+        prog->epsilonStart[state] = epsilon;
+        uint32_t first = 1;
+        for (size_t p = 0; p < numPatterns; p++) {
+            prog->epsilons[epsilon++] = first;
+            first += (uint32_t)nfas[p].numStates;
+        }
+        state++;
+    }
+
+    for (size_t p = 0; p < numPatterns; p++) {
+        struct NFA *nfa = &nfas[p];
+        uint32_t first = state;
+        for (size_t i = 0; i < nfa->numStates; i++, state++) {
+            struct State *st = &nfa->states[i];
+            prog->edgeStart[state] = edge;
+            prog->epsilonStart[state] = epsilon;
+            prog->accept[state] = st->accept;
+            prog->pattern[state] = (uint32_t)p;
+
+            for (size_t tr = 0; tr < st->numTransitions; tr++) {
+                struct Transition *t = &st->transitions[tr];
+                uint32_t next = first + (uint32_t)t->next;
+                if (t->epsilon) {
+                    prog->epsilons[epsilon++] = next;
+                } else if (t->max != 1) {
+                    uint32_t top = t->max != COUNTER_UNBOUNDED ? t->max : t->min;
+                    struct Counter *c = &prog->counters[counter];
+                    *c = (struct Counter) {
+                        .chars = t->chars, .min = t->min, .max = t->max, .entry = state, .exit = next,
+                        .word = prog->numCountWords, .numWords = top / 64 + 1
+                    };
+                    lineChars(&c->chars, lines, t->negated);
+                    prog->numCountWords += c->numWords;
+                    prog->epsilons[epsilon++] = prog->firstCounter + counter++;
+                } else {
+                    prog->edges[edge].chars = t->chars;
+                    lineChars(&prog->edges[edge].chars, lines, t->negated);
+                    prog->edges[edge++].next = next;
+                }
+            }
+        }
+    }
+    for (; state < numStates; state++) {
+        prog->edgeStart[state] = edge;
+        prog->epsilonStart[state] = epsilon;
+        prog->pattern[state] = prog->pattern[prog->counters[state - prog->firstCounter].entry];
+    }
+    prog->edgeStart[numStates] = edge;
+    prog->epsilonStart[numStates] = epsilon;
+    computeByteClasses(prog);
+    computeClosures(prog);
+    prog->emptyPattern = findEmptyPattern(prog);
+    prog->glushkov = compileGlushkov(prog);
+    prog->reverse = reverseProgram(prog);
+    return prog;
+}
+
+void freeProgram(struct Program *prog) {
+    free(prog->closureStart);
+    free(prog->closures);
+    if (prog->mapping) {
+        // Only the structs are allocated, the arrays are part of the mapping
+        free(prog->literals);
+        free(prog->glushkov);
+        freeProgram(prog->reverse);
+        munmap(prog->mapping, prog->mappingSize);
+        free(prog);
+        return;
+    }
+    if (prog->literals) {
+        freeLiteralSet(prog->literals);
+    }
+    if (prog->glushkov) {
+        freeGlushkov(prog->glushkov);
+    }
+    if (prog->reverse) {
+        freeProgram(prog->reverse);
+    }
+    free(prog);
+}
+
+// --------------------------------------------------------------------------- // 
+// --------------------------------------------------------------------------- // 
+
+/*
+    Pattern cache
+
+    A compiled program can be saved to a file and mapped back in by a later run,
+    skipping constructNFA and compileNFA. The file also holds the states the lazy
+    DFA had built by the end of the run that saved it, which newDFA then starts
+    with. Files are named after a hash of the patterns and of the options they
+    were compiled with (PDA_LINES and PDA_CASELESS), and hold the patterns
+    themselves to rule out collisions. They are only meant to be read on the
+    machine that wrote them. The header holds a checksum of the whole file, which
+    is checked before any of it is used: the arrays are mapped as they are, and a
+    damaged index in them would send the search out of bounds.
+
+    After a header the file holds these sections, each padded to 8 bytes:
+        the patterns, each followed by a NUL
+        edgeStart, edges, epsilonStart, epsilons, pattern, accept, counters
+            and the prefilter literal of the program, then the same of its
+            reverse
+        the byte classes
+        first, last, chars and follow of the bit-parallel engine, if any
+        byteClass, next, depth, literal, suffixLength and suffixPattern of the
+            literal set, if any
+        the DFA snapshot (see dfaSnapshot)
+*/
+
+#define CACHE_MAGIC "PDAC"
+#define CACHE_VERSION 5
+#define CACHE_HAS_GLUSHKOV 1
+#define CACHE_HAS_LITERALS 2
+
+struct CacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t key;
+    uint64_t size;              // Of the whole file
+    uint64_t patternBytes;
+    uint32_t numStates;
+    uint32_t numPatterns;
+    uint32_t numEdges;
+    uint32_t numEpsilons;
+    uint32_t options;
+    uint32_t flags;
+    uint64_t literalLength;
+    uint64_t rare1, rare2;
+    uint32_t numGlushkovChunks;
+    uint32_t numLiteralClasses;
+    uint32_t numLiteralNodes;
+    uint32_t numDfaStates;
+    uint32_t numByteClasses;
+    uint32_t numCounters;
+    uint64_t numDfaWords;
+    uint64_t checksum;          // Of the sections, then of the header with this field zero
+};
+
+// FNV-1a over the patterns, with their lengths so that they cannot run together
+uint64_t programKey(char **patterns, size_t numPatterns, unsigned options) {
+    uint64_t h = 1469598103934665603ULL ^ CACHE_VERSION ^ ((uint64_t)options << 8);
+    for (size_t p = 0; p < numPatterns; p++) {
+        size_t length = strlen(patterns[p]);
+        const unsigned char *bytes = (const unsigned char *)patterns[p];
+        for (size_t i = 0; i <= length; i++) {
+            h = (h ^ bytes[i]) * 1099511628211ULL;
+        }
+    }
+    return h;
+}
+
+// FNV-1a over 64-bit words, the last one padded with zeros as the sections are
+static uint64_t cacheChecksum(uint64_t h, const void *data, size_t size) {
+    const char *bytes = data;
+    for (size_t i = 0; i < size; i += 8) {
+        uint64_t word = 0;
+        memcpy(&word, bytes + i, size - i < 8 ? size - i : 8);
+        h = (h ^ word) * 1099511628211ULL;
+        h ^= h >> 32;
+    }
+    return h;
+}
+
+struct CacheWriter {
+    FILE *file;
+    uint64_t size;
+    uint64_t checksum;
+    bool ok;
+};
+
+static void cacheWrite(struct CacheWriter *w, const void *data, size_t size) {
+    static const char padding[8] = {0};
+    if (size == 0) {
+        return;
+    }
+    size_t padded = arenaAlign(size);
+    w->checksum = cacheChecksum(w->checksum, data, size);
+    w->ok = w->ok && fwrite(data, 1, size, w->file) == size &&
+            fwrite(padding, 1, padded - size, w->file) == padded - size;
+    w->size += padded;
+}
+
+static void cacheWriteProgram(struct CacheWriter *w, const struct Program *prog) {
+    uint32_t n = prog->numStates;
+    cacheWrite(w, prog->edgeStart, (n + 1) * sizeof(uint32_t));
+    cacheWrite(w, prog->edges, prog->edgeStart[n] * sizeof(struct Edge));
+    cacheWrite(w, prog->epsilonStart, (n + 1) * sizeof(uint32_t));
+    cacheWrite(w, prog->epsilons, prog->epsilonStart[n] * sizeof(uint32_t));
+    cacheWrite(w, prog->pattern, n * sizeof(uint32_t));
+    cacheWrite(w, prog->accept, n * sizeof(bool));
+    cacheWrite(w, prog->counters, prog->numCounters * sizeof(struct Counter));
+    cacheWrite(w, prog->prefilter.literal, prog->prefilter.length);
+}
+
+// Writes every section after the header in order, or with a NULL file only adds up their sizes
+static bool cacheWriteSections(struct CacheWriter *w, const struct CacheHeader *header, const struct Program *prog,
+                               const char *patternText, const uint32_t *dfaWords) {
+    cacheWrite(w, patternText, header->patternBytes);
+    cacheWriteProgram(w, prog);
+    cacheWriteProgram(w, prog->reverse);
+    cacheWrite(w, prog->byteClass, sizeof(prog->byteClass));
+
+    if (prog->glushkov) {
+        const struct Glushkov *g = prog->glushkov;
+        cacheWrite(w, &g->first, sizeof(uint64_t));
+        cacheWrite(w, &g->last, sizeof(uint64_t));
+        cacheWrite(w, g->chars, sizeof(g->chars));
+        cacheWrite(w, g->follow, header->numGlushkovChunks * sizeof(*g->follow));
+    }
+    if (prog->literals) {
+        const struct LiteralSet *set = prog->literals;
+        cacheWrite(w, set->byteClass, sizeof(set->byteClass));
+        cacheWrite(w, set->next, (size_t)set->numNodes * set->numClasses * sizeof(uint32_t));
+        cacheWrite(w, set->depth, set->numNodes * sizeof(uint32_t));
+        cacheWrite(w, set->literal, set->numNodes * sizeof(uint32_t));
+        cacheWrite(w, set->suffixLength, set->numNodes * sizeof(uint32_t));
+        cacheWrite(w, set->suffixPattern, set->numNodes * sizeof(uint32_t));
+    }
+    cacheWrite(w, dfaWords, header->numDfaWords * sizeof(uint32_t));
+    return w->ok;
+}
+
+/*
+    Saves the program, and the states dfa (which may be NULL) has built, to path.
+    The file is written under a temporary name and renamed into place, so that a
+    concurrent run never maps a partial file.
+*/
+bool saveProgram(const char *path, const struct Program *prog, const struct DFA *dfa, char **patterns,
+                 size_t numPatterns, unsigned options) {
+    struct CacheHeader header = {
+        .version = CACHE_VERSION,
+        .key = programKey(patterns, numPatterns, options),
+        .numStates = prog->numStates,
+        .numPatterns = prog->numPatterns,
+        .numEdges = prog->edgeStart[prog->numStates],
+        .numEpsilons = prog->epsilonStart[prog->numStates],
+        .numCounters = prog->numCounters,
+        .options = options,
+        .flags = (prog->glushkov ? CACHE_HAS_GLUSHKOV : 0) | (prog->literals ? CACHE_HAS_LITERALS : 0),
+        .literalLength = prog->prefilter.length,
+        .rare1 = prog->prefilter.rare1,
+        .rare2 = prog->prefilter.rare2,
+        .numGlushkovChunks = prog->glushkov ? prog->glushkov->numChunks : 0,
+        .numLiteralClasses = prog->literals ? prog->literals->numClasses : 0,
+        .numLiteralNodes = prog->literals ? prog->literals->numNodes : 0,
+        .numDfaStates = dfa ? (uint32_t)dfa->numStates : 0,
+        .numByteClasses = prog->numByteClasses
+    };
+    memcpy(header.magic, CACHE_MAGIC, 4);
+    for (size_t p = 0; p < numPatterns; p++) {
+        header.patternBytes += strlen(patterns[p]) + 1;
+    }
+    char *patternText = malloc(header.patternBytes);
+    for (size_t p = 0, at = 0; p < numPatterns; p++) {
+        memcpy(patternText + at, patterns[p], strlen(patterns[p]) + 1);
+        at += strlen(patterns[p]) + 1;
+    }
+    uint32_t *dfaWords = NULL;
+    if (dfa) {
+        header.numDfaWords = dfaSnapshot(dfa, &dfaWords);
+    }
+
+    // Size and checksum the file up front, so that the header can hold both
+    struct CacheWriter sizer = {
+        .file = NULL, .size = sizeof(struct CacheHeader), .checksum = 1469598103934665603ULL, .ok = false
+    };
+    cacheWriteSections(&sizer, &header, prog, patternText, dfaWords);
+    header.size = sizer.size;
+    header.checksum = cacheChecksum(sizer.checksum, &header, sizeof(header));
+
+    char *tempPath = malloc(strlen(path) + 32);
+    sprintf(tempPath, "%s.%ld.tmp", path, (long)getpid());
+    struct CacheWriter w = { .file = fopen(tempPath, "wb"), .size = 0, .ok = true };
+    bool ok = w.file != NULL;
+    if (ok) {
+        cacheWrite(&w, &header, sizeof(header));
+        ok = cacheWriteSections(&w, &header, prog, patternText, dfaWords);
+        ok = fclose(w.file) == 0 && ok;
+        ok = ok && rename(tempPath, path) == 0;
+        if (!ok) {
+            unlink(tempPath);
+        }
+    }
+    free(tempPath);
+    free(patternText);
+    free(dfaWords);
+    return ok;
+}
+
+struct CacheReader {
+    const char *data;
+    size_t size;
+    size_t offset;
+    bool ok;
+};
+
+// Returns the next section of the given size, or NULL past the end of the file
+static const void *cacheRead(struct CacheReader *r, uint64_t size) {
+    if (!r->ok || size > r->size - r->offset || arenaAlign(size) > r->size - r->offset) {
+        r->ok = false;
+        return NULL;
+    }
+    const void *section = r->data + r->offset;
+    r->offset += arenaAlign(size);
+    return section;
+}
+
+static struct Program *cacheReadProgram(struct CacheReader *r, const struct CacheHeader *header,
+                                        uint64_t literalLength) {
+    uint32_t n = header->numStates;
+    struct Program *prog = calloc(1, sizeof(struct Program));
+    prog->numStates = n;
+    prog->numPatterns = header->numPatterns;
+    prog->edgeStart = (uint32_t *)cacheRead(r, (n + 1) * (uint64_t)sizeof(uint32_t));
+    prog->edges = (struct Edge *)cacheRead(r, header->numEdges * (uint64_t)sizeof(struct Edge));
+    prog->epsilonStart = (uint32_t *)cacheRead(r, (n + 1) * (uint64_t)sizeof(uint32_t));
+    prog->epsilons = (uint32_t *)cacheRead(r, header->numEpsilons * (uint64_t)sizeof(uint32_t));
+    prog->pattern = (uint32_t *)cacheRead(r, n * (uint64_t)sizeof(uint32_t));
+    prog->accept = (bool *)cacheRead(r, n * (uint64_t)sizeof(bool));
+    prog->counters = (struct Counter *)cacheRead(r, header->numCounters * (uint64_t)sizeof(struct Counter));
+    prog->numCounters = header->numCounters;
+    prog->firstCounter = n - header->numCounters;
+    if (prog->counters) {
+        for (uint32_t k = 0; k < prog->numCounters; k++) {
+            prog->numCountWords += prog->counters[k].numWords;
+        }
+    }
+    prog->prefilter.literal = (char *)cacheRead(r, literalLength);
+    prog->prefilter.length = literalLength;
+    prog->prefilter.rare1 = literalLength > 0 ? header->rare1 : 0;
+    prog->prefilter.rare2 = literalLength > 0 ? header->rare2 : 0;
+    return prog;
+}
+
+// Whether the words hold count DFA states over numStates program states and numClasses byte classes
+static bool validDfaSnapshot(const uint32_t *words, uint64_t numWords, uint32_t count, uint32_t numStates,
+                             uint32_t numClasses) {
+    uint64_t w = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (w >= numWords || words[w] > numStates || words[w] >= numWords - w) {
+            return false;
+        }
+        for (uint32_t k = 1; k <= words[w]; k++) {
+            if (words[w + k] >= numStates) {
+                return false;
+            }
+        }
+        w += 1 + words[w];
+    }
+    return numWords - w == (uint64_t)count * numClasses;
+}
+
+/*
+    Maps the program saved at path for these patterns. Returns NULL if there is no
+    such file, if it was written for other patterns or by another version, or if
+    it does not match its checksum.
+*/
+struct Program *loadProgram(const char *path, char **patterns, size_t numPatterns, unsigned options) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct CacheHeader)) {
+        close(fd);
+        return NULL;
+    }
+    size_t size = (size_t)st.st_size;
+    char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+
+    struct CacheReader r = { .data = data, .size = size, .offset = 0, .ok = true };
+    const struct CacheHeader *header = cacheRead(&r, sizeof(struct CacheHeader));
+    bool valid = memcmp(header->magic, CACHE_MAGIC, 4) == 0 && header->version == CACHE_VERSION &&
+                 header->key == programKey(patterns, numPatterns, options) && header->size == size &&
+                 header->numPatterns == numPatterns && header->options == options && header->numStates > 0 &&
+                 header->numCounters < header->numStates &&
+                 header->numByteClasses > 0 && header->numByteClasses <= 256;
+    if (valid) {
+        struct CacheHeader unsummed = *header;
+        unsummed.checksum = 0;
+        uint64_t checksum = cacheChecksum(1469598103934665603ULL, data + sizeof(struct CacheHeader),
+                                          size - sizeof(struct CacheHeader));
+        valid = cacheChecksum(checksum, &unsummed, sizeof(unsummed)) == header->checksum;
+    }
+    if (valid) {
+        const char *saved = cacheRead(&r, header->patternBytes);
+        uint64_t remaining = saved ? header->patternBytes : 0;
+        for (size_t p = 0; p < numPatterns && valid; p++) {
+            size_t length = strlen(patterns[p]) + 1;
+            valid = length <= remaining && memcmp(saved, patterns[p], length) == 0;
+            saved += length;
+            remaining -= valid ? length : 0;
+        }
+        valid = valid && remaining == 0;
+    }
+    if (!valid || !r.ok) {
+        munmap(data, size);
+        return NULL;
+    }
+
+    struct Program *prog = cacheReadProgram(&r, header, header->literalLength);
+    prog->reverse = cacheReadProgram(&r, header, 0);
+    prog->mapping = data;
+    prog->mappingSize = size;
+    const uint8_t *byteClass = cacheRead(&r, sizeof(prog->byteClass));
+    if (byteClass) {
+        memcpy(prog->byteClass, byteClass, sizeof(prog->byteClass));
+        memcpy(prog->reverse->byteClass, byteClass, sizeof(prog->byteClass));
+    }
+    prog->numByteClasses = prog->reverse->numByteClasses = header->numByteClasses;
+
+    if (header->flags & CACHE_HAS_GLUSHKOV) {
+        struct Glushkov *g = calloc(1, sizeof(struct Glushkov));
+        const uint64_t *first = cacheRead(&r, sizeof(uint64_t));
+        const uint64_t *last = cacheRead(&r, sizeof(uint64_t));
+        const uint64_t *chars = cacheRead(&r, sizeof(g->chars));
+        g->numChunks = header->numGlushkovChunks;
+        g->follow = (uint64_t (*)[256])cacheRead(&r, g->numChunks * (uint64_t)sizeof(*g->follow));
+        if (r.ok) {
+            g->first = *first;
+            g->last = *last;
+            memcpy(g->chars, chars, sizeof(g->chars));
+        }
+        prog->glushkov = g;
+    }
+    if (header->flags & CACHE_HAS_LITERALS) {
+        struct LiteralSet *set = calloc(1, sizeof(struct LiteralSet));
+        uint64_t nodes = header->numLiteralNodes;
+        set->numClasses = header->numLiteralClasses;
+        set->numNodes = header->numLiteralNodes;
+        const uint8_t *byteClass = cacheRead(&r, sizeof(set->byteClass));
+        set->next = (uint32_t *)cacheRead(&r, nodes * set->numClasses * sizeof(uint32_t));
+        set->depth = (uint32_t *)cacheRead(&r, nodes * sizeof(uint32_t));
+        set->literal = (uint32_t *)cacheRead(&r, nodes * sizeof(uint32_t));
+        set->suffixLength = (uint32_t *)cacheRead(&r, nodes * sizeof(uint32_t));
+        set->suffixPattern = (uint32_t *)cacheRead(&r, nodes * sizeof(uint32_t));
+        if (r.ok) {
+            memcpy(set->byteClass, byteClass, sizeof(set->byteClass));
+        }
+        prog->literals = set;
+    }
+    prog->dfaStates = cacheRead(&r, header->numDfaWords * sizeof(uint32_t));
+    if (r.ok && validDfaSnapshot(prog->dfaStates, header->numDfaWords, header->numDfaStates, header->numStates,
+                                 header->numByteClasses)) {
+        prog->numDfaStates = header->numDfaStates;
+    }
+
+    if (!r.ok || r.offset != size) {
+        freeProgram(prog);
+        return NULL;
+    }
+    computeClosures(prog);
+    computeClosures(prog->reverse);
+    prog->emptyPattern = findEmptyPattern(prog);
+    return prog;
+}
+
+// --------------------------------------------------------------------------- // 
+// --------------------------------------------------------------------------- // 
+
+/*
+    Trigram index
+
+    A large file that is searched again and again can be indexed once with
+    --build-index. The file is split into blocks of whole lines, and for each block
+    the index records which trigrams (runs of three bytes within a line) occur in
+    it. A search with --index then works out trigrams every match must contain and
+    only scans the blocks holding all of them, along with whatever was appended to
+    the file since it was indexed.
+
+    The blocks are grouped into segments of up to INDEX_SEGMENT_BLOCKS. Each
+    segment lists the trigrams found in it in ascending order, each with the blocks
+    it occurs in (its posting list). Rebuilding the index of a file that has grown
+    only indexes the new lines: if the last segment holds fewer than
+    INDEX_MERGE_BLOCKS blocks, it is dropped and built again together with them, so
+    that appending a little at a time does not leave a trail of small segments.
+    Whether the file has merely grown is checked against a hash of its first and
+    last indexed bytes.
+
+    After a header the file holds the segments, each a struct IndexSegmentHeader
+    followed by these sections, each padded to 8 bytes:
+        blockEnds: the offset in the file just past each block
+        blockLines: the number of lines in each block
+        trigrams: the trigrams found, as b0 << 16 | b1 << 8 | b2
+        postingStart: where each trigram's posting list starts, and the end
+        postings: the blocks, counted from the start of the segment
+    Like the pattern cache, the index is only meant to be read on the machine that
+    wrote it. Only the first header.size bytes are valid: segments are written
+    before the header that takes them in, and anything past it is left over from an
+    update that did not finish.
+
+    A match can only be looked for block by block if it cannot cross a line, so the
+    index is not used for a program that can consume a newline (in line mode the
+    wildcard and negated classes cannot).
+*/
+
+#define INDEX_MAGIC "PDAI"
+#define INDEX_VERSION 1
+#define INDEX_BLOCK_SIZE (256 * 1024)
+#define INDEX_SEGMENT_BLOCKS 1024
+#define INDEX_MERGE_BLOCKS 128
+#define INDEX_HASH_BYTES 4096
+#define INDEX_NUM_TRIGRAMS (1 << 24)
+#define INDEX_MAX_PLAN_STATES 4096
+#define INDEX_MAX_REQUIREMENTS 16      // Per pattern
+#define INDEX_MAX_BYTE_CHOICES 4       // Of each byte of a required trigram
+
+struct IndexHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t size;                  // Of the valid part of the index
+    uint64_t indexedLength;         // Of the file, up to the end of a line
+    uint64_t headHash;              // Of the first INDEX_HASH_BYTES indexed bytes
+    uint64_t tailHash;              // Of the last INDEX_HASH_BYTES indexed bytes
+    uint64_t lastSegmentOffset;
+    uint32_t numSegments;
+    uint32_t numBlocks;
+};
+
+struct IndexSegmentHeader {
+    uint64_t size;                  // Of the segment, this header included
+    uint64_t start;                 // Offset in the file of its first block
+    uint32_t numBlocks;
+    uint32_t numTrigrams;
+    uint64_t numPostings;
+};
+
+struct IndexSegment {
+    uint64_t start;
+    uint32_t numBlocks;
+    uint32_t numTrigrams;
+    const uint64_t *blockEnds;
+    const uint32_t *blockLines;
+    const uint32_t *trigrams;
+    const uint32_t *postingStart;
+    const uint16_t *postings;
+};
+
+struct TrigramIndex {
+    void *mapping;
+    size_t mappingSize;
+    const struct IndexHeader *header;
+    struct IndexSegment *segments;
+    uint32_t numSegments;
+};
+
+// A run of blocks to be searched, after skippedLines lines in blocks that are not
+struct IndexRange {
+    size_t start, end;
+    size_t skippedLines;
+};
+
+/*
+    Trigrams every match must contain, for each pattern: a match of pattern p
+    contains, for every requirement r from patternStart[p] up to patternStart[p + 1],
+    one of the trigrams from requirementStart[r] up to requirementStart[r + 1]. A
+    pattern without requirements may match anywhere.
+*/
+struct IndexQuery {
+    uint32_t numPatterns;
+    uint32_t *patternStart;
+    uint32_t numRequirements;
+    uint32_t *requirementStart;
+    uint32_t *trigrams;
+};
+
+static uint64_t indexHash(const char *data, size_t length) {
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < length; i++) {
+        h = (h ^ (unsigned char)data[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static uint64_t indexHeadHash(const char *data, uint64_t indexedLength) {
+    return indexHash(data, indexedLength < INDEX_HASH_BYTES ? indexedLength : INDEX_HASH_BYTES);
+}
+
+static uint64_t indexTailHash(const char *data, uint64_t indexedLength) {
+    uint64_t length = indexedLength < INDEX_HASH_BYTES ? indexedLength : INDEX_HASH_BYTES;
+    return indexHash(data + indexedLength - length, length);
+}
+
+// Whether the index was built over the first header->indexedLength bytes of data
+static bool indexCovers(const struct IndexHeader *header, const char *data, size_t size) {
+    return header->indexedLength <= size && header->headHash == indexHeadHash(data, header->indexedLength) &&
+           header->tailHash == indexTailHash(data, header->indexedLength);
+}
+
+struct IndexBuilder {
+    uint32_t *counts;               // Per trigram, the blocks of the segment it occurs in
+    uint64_t *seen;                 // Bit per trigram, set once it occurs in the current block
+    uint32_t *found;                // The trigrams of each block of the segment in turn
+    size_t numFound;
+    size_t maxFound;
+    uint64_t blockEnds[INDEX_SEGMENT_BLOCKS];
+    uint32_t blockLines[INDEX_SEGMENT_BLOCKS];
+    size_t blockFound[INDEX_SEGMENT_BLOCKS + 1];
+};
+
+// Records the trigrams of data[start, end), which holds whole lines, as those of
+// the next block of the segment. Returns the number of lines.
+static uint32_t indexBlock(struct IndexBuilder *b, const char *data, size_t start, size_t end) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    uint32_t lines = 0;
+    uint32_t trigram = 0;
+    size_t run = 0;                 // Bytes since the last newline
+    for (size_t i = start; i < end; i++) {
+        if (bytes[i] == '\n') {
+            lines++;
+            run = 0;
+            continue;
+        }
+        trigram = (trigram << 8 | bytes[i]) & (INDEX_NUM_TRIGRAMS - 1);
+        if (++run < 3 || (b->seen[trigram >> 6] >> (trigram & 63)) & 1) {
+            continue;
+        }
+        b->seen[trigram >> 6] |= (uint64_t)1 << (trigram & 63);
+        if (b->numFound == b->maxFound) {
+            b->maxFound *= 2;
+            STAT_ADD(reallocs, 1);
+            b->found = realloc(b->found, b->maxFound * sizeof(uint32_t));
+        }
+        b->found[b->numFound++] = trigram;
+    }
+    return lines;
+}
+
+// Indexes the blocks from data offset start on into a segment, and writes it.
+// Blocks end after the first newline past INDEX_BLOCK_SIZE, and the last one at
+// end at the latest. Returns the end of the last block, and the number of blocks
+// in *numBlocks.
+static size_t writeIndexSegment(struct CacheWriter *w, struct IndexBuilder *b, const char *data, size_t start,
+                                size_t end, uint32_t *numBlocks) {
+    struct IndexSegmentHeader header = { .start = start };
+    b->numFound = 0;
+    b->blockFound[0] = 0;
+    size_t blockStart = start;
+    while (blockStart < end && header.numBlocks < INDEX_SEGMENT_BLOCKS) {
+        size_t blockEnd = end;
+        if (end - blockStart > INDEX_BLOCK_SIZE) {
+            const char *newline = memchr(data + blockStart + INDEX_BLOCK_SIZE, '\n',
+                                         end - blockStart - INDEX_BLOCK_SIZE);
+            blockEnd = newline ? (size_t)(newline - data) + 1 : end;
+        }
+        uint32_t block = header.numBlocks++;
+        b->blockLines[block] = indexBlock(b, data, blockStart, blockEnd);
+        b->blockEnds[block] = blockEnd;
+        b->blockFound[block + 1] = b->numFound;
+        for (size_t i = b->blockFound[block]; i < b->numFound; i++) {
+            uint32_t trigram = b->found[i];
+            b->seen[trigram >> 6] = 0;
+            header.numTrigrams += b->counts[trigram]++ == 0;
+        }
+        blockStart = blockEnd;
+    }
+    header.numPostings = b->numFound;
+
+    // Lay the posting lists out in trigram order, turning each count into where
+    // the trigram's next posting goes
+    uint32_t *trigrams = malloc(header.numTrigrams * sizeof(uint32_t));
+    uint32_t *postingStart = malloc((header.numTrigrams + 1) * sizeof(uint32_t));
+    uint16_t *postings = malloc(header.numPostings * sizeof(uint16_t));
+    uint32_t numTrigrams = 0, at = 0;
+    for (uint32_t trigram = 0; trigram < INDEX_NUM_TRIGRAMS && numTrigrams < header.numTrigrams; trigram++) {
+        if (b->counts[trigram] > 0) {
+            trigrams[numTrigrams] = trigram;
+            postingStart[numTrigrams++] = at;
+            at += b->counts[trigram];
+            b->counts[trigram] = at - b->counts[trigram];
+        }
+    }
+    postingStart[numTrigrams] = at;
+    for (uint32_t block = 0; block < header.numBlocks; block++) {
+        for (size_t i = b->blockFound[block]; i < b->blockFound[block + 1]; i++) {
+            postings[b->counts[b->found[i]]++] = (uint16_t)block;
+        }
+    }
+    for (uint32_t t = 0; t < numTrigrams; t++) {
+        b->counts[trigrams[t]] = 0;
+    }
+
+    header.size = arenaAlign(sizeof(header)) + arenaAlign(header.numBlocks * sizeof(uint64_t)) +
+                  arenaAlign(header.numBlocks * sizeof(uint32_t)) + arenaAlign(numTrigrams * sizeof(uint32_t)) +
+                  arenaAlign((numTrigrams + 1) * sizeof(uint32_t)) + arenaAlign(header.numPostings * sizeof(uint16_t));
+    cacheWrite(w, &header, sizeof(header));
+    cacheWrite(w, b->blockEnds, header.numBlocks * sizeof(uint64_t));
+    cacheWrite(w, b->blockLines, header.numBlocks * sizeof(uint32_t));
+    cacheWrite(w, trigrams, numTrigrams * sizeof(uint32_t));
+    cacheWrite(w, postingStart, (numTrigrams + 1) * sizeof(uint32_t));
+    cacheWrite(w, postings, header.numPostings * sizeof(uint16_t));
+    free(trigrams);
+    free(postingStart);
+    free(postings);
+    *numBlocks = header.numBlocks;
+    return blockStart;
+}
+
+/*
+    Brings the index at path up to date with data, creating it if there is none
+    or if data is not the file it was built for (or that file with lines added).
+    Fills in *result with the new header and sets *indexed to the number of bytes
+    indexed, which is more than was added if a segment had to be built again. The
+    index is updated in place and must not be searched while it is.
+*/
+bool buildIndex(const char *path, const char *data, size_t size, struct IndexHeader *result, size_t *indexed) {
+    int fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    struct IndexHeader header;
+    struct IndexSegmentHeader last;
+    bool resume = fstat(fd, &st) == 0 && pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+                  memcmp(header.magic, INDEX_MAGIC, 4) == 0 && header.version == INDEX_VERSION &&
+                  header.size >= sizeof(header) && header.size <= (uint64_t)st.st_size &&
+                  indexCovers(&header, data, size);
+    if (resume && header.numSegments > 0) {
+        // Build a small last segment again
+        resume = header.lastSegmentOffset >= sizeof(header) &&
+                 header.lastSegmentOffset + sizeof(last) <= header.size &&
+                 pread(fd, &last, sizeof(last), (off_t)header.lastSegmentOffset) == sizeof(last) &&
+                 last.start <= header.indexedLength && last.numBlocks <= header.numBlocks;
+        bool grown = size > header.indexedLength &&
+                     memchr(data + header.indexedLength, '\n', size - header.indexedLength);
+        if (resume && grown && last.numBlocks < INDEX_MERGE_BLOCKS) {
+            // Leave a valid index without it on disk in the meantime
+            header.size = header.lastSegmentOffset;
+            header.indexedLength = last.start;
+            header.headHash = indexHeadHash(data, last.start);
+            header.tailHash = indexTailHash(data, last.start);
+            header.numSegments--;
+            header.numBlocks -= last.numBlocks;
+            resume = pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+        }
+    }
+    if (!resume) {
+        header = (struct IndexHeader) { .version = INDEX_VERSION };
+    }
+
+    // Anything past the valid part is dropped, and a new index starts out with a
+    // header that is not valid until it is written again at the end
+    FILE *file = fdopen(fd, "r+b");
+    bool ok = file && ftruncate(fd, (off_t)header.size) == 0 && fseeko(file, (off_t)header.size, SEEK_SET) == 0;
+    struct CacheWriter w = { .file = file, .size = header.size, .ok = ok };
+    if (header.size == 0) {
+        cacheWrite(&w, &header, sizeof(header));
+    }
+
+    // Index up to the end of the last whole line
+    size_t from = header.indexedLength;
+    const char *lastNewline = size > from ? memrchr(data + from, '\n', size - from) : NULL;
+    size_t end = lastNewline ? (size_t)(lastNewline - data) + 1 : from;
+    struct IndexBuilder *b = malloc(sizeof(struct IndexBuilder));
+    b->counts = calloc(INDEX_NUM_TRIGRAMS, sizeof(uint32_t));
+    b->seen = calloc(INDEX_NUM_TRIGRAMS / 64, sizeof(uint64_t));
+    b->maxFound = 1 << 16;
+    b->found = malloc(b->maxFound * sizeof(uint32_t));
+    for (size_t start = from; start < end && w.ok;) {
+        uint32_t numBlocks;
+        header.lastSegmentOffset = w.size;
+        start = writeIndexSegment(&w, b, data, start, end, &numBlocks);
+        header.numSegments++;
+        header.numBlocks += numBlocks;
+    }
+    free(b->counts);
+    free(b->seen);
+    free(b->found);
+    free(b);
+
+    memcpy(header.magic, INDEX_MAGIC, 4);
+    header.size = w.size;
+    header.indexedLength = end;
+    header.headHash = indexHeadHash(data, end);
+    header.tailHash = indexTailHash(data, end);
+    ok = w.ok && fflush(file) == 0 && pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+    ok = (file ? fclose(file) == 0 : close(fd) == 0) && ok;
+    *result = header;
+    *indexed = end - from;
+    return ok;
+}
+
+void freeIndex(struct TrigramIndex *index) {
+    munmap(index->mapping, index->mappingSize);
+    free(index->segments);
+    free(index);
+}
+
+/*
+    Maps the index at path. Returns NULL if there is none, or if it is not a
+    valid index.
+*/
+struct TrigramIndex *loadIndex(const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct IndexHeader)) {
+        close(fd);
+        return NULL;
+    }
+    size_t size = (size_t)st.st_size;
+    char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+
+    struct CacheReader r = { .data = data, .size = size, .offset = 0, .ok = true };
+    const struct IndexHeader *header = cacheRead(&r, sizeof(struct IndexHeader));
+    // Every segment takes at least its header, and every block at least its end and line count
+    uint64_t room = header->size - sizeof(struct IndexHeader);
+    if (memcmp(header->magic, INDEX_MAGIC, 4) != 0 || header->version != INDEX_VERSION || header->size > size ||
+        header->size < sizeof(struct IndexHeader) || header->numSegments > room / sizeof(struct IndexSegmentHeader) ||
+        header->numBlocks > room / (sizeof(uint64_t) + sizeof(uint32_t))) {
+        munmap(data, size);
+        return NULL;
+    }
+    r.size = header->size;
+
+    struct TrigramIndex *index = calloc(1, sizeof(struct TrigramIndex));
+    index->mapping = data;
+    index->mappingSize = size;
+    index->header = header;
+    index->segments = calloc(header->numSegments, sizeof(struct IndexSegment));
+    uint64_t blockStart = 0, numBlocks = 0;
+    for (uint32_t i = 0; i < header->numSegments && r.ok; i++) {
+        size_t offset = r.offset;
+        const struct IndexSegmentHeader *sh = cacheRead(&r, sizeof(struct IndexSegmentHeader));
+        if (!sh || sh->start != blockStart || sh->numBlocks == 0 || sh->numBlocks > INDEX_SEGMENT_BLOCKS) {
+            r.ok = false;
+            break;
+        }
+        struct IndexSegment *seg = &index->segments[i];
+        seg->start = sh->start;
+        seg->numBlocks = sh->numBlocks;
+        seg->numTrigrams = sh->numTrigrams;
+        seg->blockEnds = cacheRead(&r, sh->numBlocks * (uint64_t)sizeof(uint64_t));
+        seg->blockLines = cacheRead(&r, sh->numBlocks * (uint64_t)sizeof(uint32_t));
+        seg->trigrams = cacheRead(&r, sh->numTrigrams * (uint64_t)sizeof(uint32_t));
+        seg->postingStart = cacheRead(&r, (sh->numTrigrams + 1) * (uint64_t)sizeof(uint32_t));
+        seg->postings = cacheRead(&r, sh->numPostings * (uint64_t)sizeof(uint16_t));
+        r.ok = r.ok && r.offset - offset == sh->size && seg->postingStart[sh->numTrigrams] == sh->numPostings;
+
+        // The lookups rely on these being in order
+        for (uint32_t b = 0; b < seg->numBlocks && r.ok; b++) {
+            r.ok = seg->blockEnds[b] > blockStart;
+            blockStart = seg->blockEnds[b];
+        }
+        for (uint32_t t = 0; t < seg->numTrigrams && r.ok; t++) {
+            r.ok = seg->postingStart[t] <= seg->postingStart[t + 1] &&
+                   (t == 0 || seg->trigrams[t - 1] < seg->trigrams[t]);
+        }
+        numBlocks += seg->numBlocks;
+        index->numSegments++;
+    }
+    if (!r.ok || r.offset != header->size || blockStart != header->indexedLength || numBlocks != header->numBlocks) {
+        freeIndex(index);
+        return NULL;
+    }
+    return index;
+}
+
+// Whether every path from the start state to an accepting state of pattern p
+// takes edge skip
+static bool edgeRequired(const struct Program *prog, uint32_t p, uint32_t skip, bool *visited, uint32_t *stack) {
+    memset(visited, 0, prog->numStates * sizeof(bool));
+    size_t top = 0;
+    visited[0] = true;
+    stack[top++] = 0;
+    while (top > 0) {
+        uint32_t state = stack[--top];
+        if (prog->accept[state] && prog->pattern[state] == p) {
+            return false;
+        }
+        if (state >= prog->firstCounter) {
+            uint32_t exit = prog->counters[state - prog->firstCounter].exit;
+            if (!visited[exit]) {
+                visited[exit] = true;
+                stack[top++] = exit;
+            }
+            continue;
+        }
+        for (uint32_t e = prog->edgeStart[state]; e < prog->edgeStart[state + 1]; e++) {
+            if (e != skip && !visited[prog->edges[e].next]) {
+                visited[prog->edges[e].next] = true;
+                stack[top++] = prog->edges[e].next;
+            }
+        }
+        for (uint32_t e = prog->epsilonStart[state]; e < prog->epsilonStart[state + 1]; e++) {
+            if (!visited[prog->epsilons[e]]) {
+                visited[prog->epsilons[e]] = true;
+                stack[top++] = prog->epsilons[e];
+            }
+        }
+    }
+    return true;
+}
+
+// Returns the edge every thread in state has to leave it by, the next byte being
+// one of a few, or UINT32_MAX if there is no such edge
+static uint32_t onlyEdge(const struct Program *prog, uint32_t state) {
+    if (state >= prog->firstCounter || prog->epsilonStart[state] != prog->epsilonStart[state + 1] ||
+        prog->edgeStart[state + 1] - prog->edgeStart[state] != 1) {
+        return UINT32_MAX;
+    }
+    return prog->edgeStart[state];
+}
+
+static size_t byteSetCount(const struct ByteSet *set) {
+    size_t count = 0;
+    for (int i = 0; i < 4; i++) {
+        count += (size_t)__builtin_popcountll(set->bits[i]);
+    }
+    return count;
+}
+
+/*
+    Works out the trigrams the matches of each pattern must contain. A consuming
+    edge is required if taking it away leaves no way from the start state to an
+    accepting state of the pattern. Three required edges in a row, each of whose
+    states can only be left by the next, consume three bytes in a row, and each
+    byte is one of a few. Returns NULL if a match may contain a newline, since the
+    index cannot help then, or if the program is too large to be worth the effort.
+*/
+struct IndexQuery *planIndexQuery(const struct Program *prog) {
+    if (prog->numStates > INDEX_MAX_PLAN_STATES) {
+        return NULL;
+    }
+    uint32_t numEdges = prog->edgeStart[prog->numStates];
+    for (uint32_t e = 0; e < numEdges; e++) {
+        if (byteSetHas(&prog->edges[e].chars, '\n')) {
+            return NULL;
+        }
+    }
+    for (uint32_t k = 0; k < prog->numCounters; k++) {
+        if (byteSetHas(&prog->counters[k].chars, '\n')) {
+            return NULL;
+        }
+    }
+
+    struct IndexQuery *query = calloc(1, sizeof(struct IndexQuery));
+    query->numPatterns = prog->numPatterns;
+    query->patternStart = malloc((prog->numPatterns + 1) * sizeof(uint32_t));
+    query->requirementStart = malloc((prog->numPatterns * INDEX_MAX_REQUIREMENTS + 1) * sizeof(uint32_t));
+    size_t maxChoices = INDEX_MAX_BYTE_CHOICES * INDEX_MAX_BYTE_CHOICES * INDEX_MAX_BYTE_CHOICES;
+    query->trigrams = malloc(prog->numPatterns * INDEX_MAX_REQUIREMENTS * maxChoices * sizeof(uint32_t));
+    bool *visited = malloc(prog->numStates * sizeof(bool));
+    uint32_t *stack = malloc(prog->numStates * sizeof(uint32_t));
+    int8_t *required = malloc(numEdges * sizeof(int8_t));      // -1 until worked out
+    memset(required, -1, numEdges * sizeof(int8_t));
+
+    uint32_t numTrigrams = 0;
+    query->requirementStart[0] = 0;
+    for (uint32_t p = 0; p < prog->numPatterns; p++) {
+        query->patternStart[p] = query->numRequirements;
+        for (uint32_t state = 0; state < prog->numStates; state++) {
+            if (prog->pattern[state] != p) {
+                continue;
+            }
+            for (uint32_t e = prog->edgeStart[state]; e < prog->edgeStart[state + 1]; e++) {
+                if (query->numRequirements - query->patternStart[p] == INDEX_MAX_REQUIREMENTS) {
+                    break;
+                }
+
+                // Follow the edge through two more
+                uint32_t run[3] = { e, UINT32_MAX, UINT32_MAX };
+                bool found = true;
+                for (int i = 0; i < 3 && found; i++) {
+                    if (i > 0) {
+                        run[i] = onlyEdge(prog, prog->edges[run[i - 1]].next);
+                    }
+                    found = run[i] != UINT32_MAX &&
+                            byteSetCount(&prog->edges[run[i]].chars) <= INDEX_MAX_BYTE_CHOICES;
+                    if (found && required[run[i]] < 0) {
+                        required[run[i]] = edgeRequired(prog, p, run[i], visited, stack);
+                    }
+                    found = found && required[run[i]];
+                }
+                if (!found) {
+                    continue;
+                }
+
+                // Any combination of the bytes of the three edges will do
+                for (int b0 = 0; b0 < 256; b0++) {
+                    if (!byteSetHas(&prog->edges[run[0]].chars, (unsigned char)b0)) {
+                        continue;
+                    }
+                    for (int b1 = 0; b1 < 256; b1++) {
+                        if (!byteSetHas(&prog->edges[run[1]].chars, (unsigned char)b1)) {
+                            continue;
+                        }
+                        for (int b2 = 0; b2 < 256; b2++) {
+                            if (byteSetHas(&prog->edges[run[2]].chars, (unsigned char)b2)) {
+                                query->trigrams[numTrigrams++] = (uint32_t)(b0 << 16 | b1 << 8 | b2);
+                            }
+                        }
+                    }
+                }
+                query->requirementStart[++query->numRequirements] = numTrigrams;
+            }
+        }
+    }
+    query->patternStart[prog->numPatterns] = query->numRequirements;
+    free(visited);
+    free(stack);
+    free(required);
+    return query;
+}
+
+void freeIndexQuery(struct IndexQuery *query) {
+    free(query->patternStart);
+    free(query->requirementStart);
+    free(query->trigrams);
+    free(query);
+}
+
+// Adds the blocks trigram occurs in to the bitmap
+static void addPostings(const struct IndexSegment *seg, uint32_t trigram, uint64_t *blocks) {
+    size_t low = 0, high = seg->numTrigrams;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (seg->trigrams[mid] < trigram) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low == seg->numTrigrams || seg->trigrams[low] != trigram) {
+        return;
+    }
+    for (uint32_t i = seg->postingStart[low]; i < seg->postingStart[low + 1]; i++) {
+        if (seg->postings[i] < seg->numBlocks) {
+            blocks[seg->postings[i] >> 6] |= (uint64_t)1 << (seg->postings[i] & 63);
+        }
+    }
+}
+
+// Adds the range from start to end to the list, joining it to the last range if
+// it follows on from it
+static void addIndexRange(struct IndexRange **ranges, size_t *numRanges, size_t *maxRanges, size_t start,
+                          size_t end, size_t skippedLines) {
+    if (*numRanges > 0 && skippedLines == 0 && (*ranges)[*numRanges - 1].end == start) {
+        (*ranges)[*numRanges - 1].end = end;
+        return;
+    }
+    if (*numRanges == *maxRanges) {
+        *maxRanges = *maxRanges == 0 ? 16 : *maxRanges * 2;
+        STAT_ADD(reallocs, 1);
+        *ranges = realloc(*ranges, *maxRanges * sizeof(struct IndexRange));
+    }
+    (*ranges)[(*numRanges)++] = (struct IndexRange) { .start = start, .end = end, .skippedLines = skippedLines };
+}
+
+/*
+    Lists the parts of a file of the given size that may hold a match of the query
+    in *ranges, in order: the blocks of the index that hold a required trigram of
+    every requirement of some pattern, and whatever follows the indexed part.
+    Returns the number of ranges.
+*/
+size_t indexCandidates(const struct TrigramIndex *index, const struct IndexQuery *query, size_t size,
+                       struct IndexRange **ranges) {
+    size_t numRanges = 0, maxRanges = 0;
+    size_t skippedLines = 0;
+    *ranges = NULL;
+    uint64_t *candidates = malloc(INDEX_SEGMENT_BLOCKS / 64 * sizeof(uint64_t));
+    uint64_t *matching = malloc(INDEX_SEGMENT_BLOCKS / 64 * sizeof(uint64_t));
+    uint64_t *requirement = malloc(INDEX_SEGMENT_BLOCKS / 64 * sizeof(uint64_t));
+    for (uint32_t i = 0; i < index->numSegments; i++) {
+        const struct IndexSegment *seg = &index->segments[i];
+        size_t words = (seg->numBlocks + 63) / 64;
+        memset(candidates, 0, words * sizeof(uint64_t));
+        for (uint32_t p = 0; p < query->numPatterns; p++) {
+            memset(matching, 0xff, words * sizeof(uint64_t));
+            for (uint32_t r = query->patternStart[p]; r < query->patternStart[p + 1]; r++) {
+                memset(requirement, 0, words * sizeof(uint64_t));
+                for (uint32_t t = query->requirementStart[r]; t < query->requirementStart[r + 1]; t++) {
+                    addPostings(seg, query->trigrams[t], requirement);
+                }
+                for (size_t w = 0; w < words; w++) {
+                    matching[w] &= requirement[w];
+                }
+            }
+            for (size_t w = 0; w < words; w++) {
+                candidates[w] |= matching[w];
+            }
+        }
+
+        size_t blockStart = seg->start;
+        for (uint32_t b = 0; b < seg->numBlocks; b++) {
+            if ((candidates[b >> 6] >> (b & 63)) & 1) {
+                STAT_ADD(indexCandidates, 1);
+                addIndexRange(ranges, &numRanges, &maxRanges, blockStart, seg->blockEnds[b], skippedLines);
+                skippedLines = 0;
+            } else {
+                skippedLines += seg->blockLines[b];
+            }
+            blockStart = seg->blockEnds[b];
+        }
+        STAT_ADD(indexBlocks, seg->numBlocks);
+    }
+    free(candidates);
+    free(matching);
+    free(requirement);
+
+    if (size > index->header->indexedLength) {
+        addIndexRange(ranges, &numRanges, &maxRanges, index->header->indexedLength, size, skippedLines);
+    }
+    return numRanges;
+}
+
+// --------------------------------------------------------------------------- // 
+// --------------------------------------------------------------------------- // 
+
+/*
+    Code generation
+
+    For patterns that never change, emitMatcher writes out a C source file that
+    searches for them with no interpretation left: the forward DFA runDFA would
+    build lazily is built in full, along with a DFA over the reversed program for
+    runReverse's walk back to the start, and both are written as static const
+    tables indexed by byte class. The generated function finds the same matches
+    as nextMatch without -g: the earliest end, then the leftmost start, then the
+    lowest pattern.
+
+    Both DFAs are built with a struct DFA large enough never to flush. Forward DFA
+    state 0 is the empty set, where no partial match is alive, and the accepting
+    states are numbered last so that one comparison tells them apart. The scan
+    stops at the first of them, so their transitions are never built. The forward
+    table holds each target already multiplied by the number of byte classes, to
+    save a multiplication per byte. Reverse DFA state 0 is also the empty set,
+    where the walk back stops.
+*/
+
+#define EMIT_MAX_STATES 16384
+#define EMIT_ROW_VALUES 16          // Table entries per line of generated code
+
+// Builds every state reachable from the first one interned, except past the
+// accepting states of a forward DFA. Returns false if there are too many.
+static bool emitBuildDFA(struct DFA *dfa, const uint8_t *representative, bool forward) {
+    for (size_t i = 0; i < dfa->numStates; i++) {
+        struct DFAState *ds = dfa->states[i];
+        if (forward && ds->accept) {
+            continue;
+        }
+        for (uint32_t c = 0; c < dfa->prog->numByteClasses; c++) {
+            if (!ds->next[c] && !dfaStep(dfa, ds, representative[c])) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void emitString(FILE *file, const char *text, size_t length) {
+    fputc('"', file);
+    for (const unsigned char *p = (const unsigned char *)text; p < (const unsigned char *)text + length; p++) {
+        if (*p == '"' || *p == '\\') {
+            fprintf(file, "\\%c", *p);
+        } else if (*p < 0x20 || *p >= 0x7f) {
+            fprintf(file, "\\%03o", *p);
+        } else {
+            fputc(*p, file);
+        }
+    }
+    fputc('"', file);
+}
+
+// Writes the transitions of each DFA state, in the order given by ids if set, with
+// the targets renumbered the same way and multiplied by scale. Rows of states that
+// are never left are zero.
+static void emitTable(FILE *file, const char *name, const char *table, const struct DFA *dfa, const uint32_t *ids,
+                      bool forward, uint32_t scale) {
+    uint32_t numClasses = dfa->prog->numByteClasses;
+    uint32_t *order = malloc(dfa->numStates * sizeof(uint32_t));
+    for (size_t i = 0; i < dfa->numStates; i++) {
+        order[ids ? ids[i] : i] = (uint32_t)i;
+    }
+    bool wide = dfa->numStates * scale > UINT16_MAX;
+    fprintf(file, "static const uint%d_t %s_%s[%zu] = {\n", wide ? 32 : 16, name, table, dfa->numStates * numClasses);
+    for (size_t i = 0; i < dfa->numStates; i++) {
+        const struct DFAState *ds = dfa->states[order[i]];
+        for (uint32_t c = 0; c < numClasses; c++) {
+            uint32_t next = forward && ds->accept ? 0 : ds->next[c]->id;
+            fprintf(file, "%s%u,", c % EMIT_ROW_VALUES == 0 ? "    " : " ", (ids ? ids[next] : next) * scale);
+            if (c % EMIT_ROW_VALUES == EMIT_ROW_VALUES - 1 || c == numClasses - 1) {
+                fputc('\n', file);
+            }
+        }
+    }
+    fprintf(file, "};\n\n");
+    free(order);
+}
+
+// Writes <name>_findPrefix, which is findPrefix specialized to the literal
+static void emitFindPrefix(FILE *file, const struct Prefilter *pf, const char *name) {
+    fprintf(file, "static const char %s_prefix[] = ", name);
+    emitString(file, pf->literal, pf->length);
+    fprintf(file, ";\n\n");
+    fprintf(file, "// Returns the offset of the first occurrence of the literal every match starts\n");
+    fprintf(file, "// with, or length if there is none\n");
+    fprintf(file, "static size_t %s_findPrefix(const unsigned char *in, size_t length) {\n", name);
+    fprintf(file, "    if (length < %zu) {\n        return length;\n    }\n", pf->length);
+    fprintf(file, "    size_t last = length - %zu;\n    size_t pos = 0;\n", pf->length);
+    if (pf->rare1 != pf->rare2) {
+        fprintf(file, "#ifdef __SSE2__\n");
+        fprintf(file, "    __m128i byte1 = _mm_set1_epi8(%d), byte2 = _mm_set1_epi8(%d);\n",
+                (signed char)pf->literal[pf->rare1], (signed char)pf->literal[pf->rare2]);
+        fprintf(file, "    for (; pos + 16 <= last + 1; pos += 16) {\n");
+        fprintf(file, "        __m128i block1 = _mm_loadu_si128((const __m128i *)(in + pos + %zu));\n", pf->rare1);
+        fprintf(file, "        __m128i block2 = _mm_loadu_si128((const __m128i *)(in + pos + %zu));\n", pf->rare2);
+        fprintf(file, "        __m128i both = _mm_and_si128(_mm_cmpeq_epi8(block1, byte1),\n");
+        fprintf(file, "                                     _mm_cmpeq_epi8(block2, byte2));\n");
+        fprintf(file, "        unsigned mask = (unsigned)_mm_movemask_epi8(both);\n");
+        fprintf(file, "        while (mask) {\n");
+        fprintf(file, "            size_t candidate = pos + (size_t)__builtin_ctz(mask);\n");
+        fprintf(file, "            if (memcmp(in + candidate, %s_prefix, %zu) == 0) {\n", name, pf->length);
+        fprintf(file, "                return candidate;\n            }\n            mask &= mask - 1;\n        }\n");
+        fprintf(file, "    }\n#endif\n");
+    }
+    fprintf(file, "    while (pos <= last) {\n");
+    fprintf(file, "        const unsigned char *hit = memchr(in + pos + %zu, %u, last - pos + 1);\n", pf->rare1,
+            (unsigned char)pf->literal[pf->rare1]);
+    fprintf(file, "        if (!hit) {\n            break;\n        }\n");
+    fprintf(file, "        size_t candidate = (size_t)(hit - in) - %zu;\n", pf->rare1);
+    fprintf(file, "        if (memcmp(in + candidate, %s_prefix, %zu) == 0) {\n", name, pf->length);
+    fprintf(file, "            return candidate;\n        }\n        pos = candidate + 1;\n    }\n");
+    fprintf(file, "    return length;\n}\n\n");
+}
+
+/*
+    Writes a C file defining
+
+        int <name>_search(const char *input, size_t length, size_t *start, size_t *matchLength);
+
+    which returns the index of the pattern found in input, counting from 0, or -1 if
+    there is no match, and the names of the patterns as <name>_patterns. Returns false with
+    *error set if the program has counters or the DFAs would be too large.
+*/
+bool emitMatcher(FILE *file, const struct Program *prog, char *const *patterns, const char *name, const char **error) {
+    if (prog->numCounters > 0) {
+        *error = "a counted repetition too large to unroll cannot be generated";
+        return false;
+    }
+    uint8_t representative[256];
+    for (int ch = 255; ch >= 0; ch--) {
+        representative[prog->byteClass[ch]] = (uint8_t)ch;
+    }
+
+    // The forward DFA starts from the empty set and re-adds the start state's
+    // closure at every byte, as runDFA does
+    struct DFA *forward = newDFA(prog, EMIT_MAX_STATES);
+    dfaIntern(forward, 0);
+    bool ok = emitBuildDFA(forward, representative, true);
+
+    // The reverse DFA starts from the closure of every accepting state, as
+    // runReverse does, and is anchored at the end so nothing is re-added
+    struct DFA *reverse = newDFA(prog->reverse, EMIT_MAX_STATES);
+    reverse->numStartClosure = 0;
+    dfaIntern(reverse, 0);
+    size_t stackTop = 0;
+    for (uint32_t state = 0; state < prog->numStates; state++) {
+        if (prog->accept[state]) {
+            reverse->inSet[state] = true;
+            reverse->stack[stackTop++] = state;
+        }
+    }
+    struct DFAState *reverseStart = dfaIntern(reverse, dfaCollectClosure(reverse, reverse->stack, stackTop));
+    ok = ok && emitBuildDFA(reverse, representative, false);
+    if (!ok) {
+        *error = "the DFA has too many states";
+        freeDFA(forward);
+        freeDFA(reverse);
+        return false;
+    }
+
+    // Number the accepting forward states last
+    uint32_t *forwardIds = malloc(forward->numStates * sizeof(uint32_t));
+    uint32_t firstAccept = 0;
+    for (size_t i = 0; i < forward->numStates; i++) {
+        if (!forward->states[i]->accept) {
+            forwardIds[i] = firstAccept++;
+        }
+    }
+    uint32_t id = firstAccept;
+    for (size_t i = 0; i < forward->numStates; i++) {
+        if (forward->states[i]->accept) {
+            forwardIds[i] = id++;
+        }
+    }
+
+    fprintf(file, "/*\n    Matcher generated by pda --emit-c. Do not edit.\n\n");
+    fprintf(file, "    %s_search finds the earliest-ending match of %s in input, as pda\n",
+            name, prog->numPatterns > 1 ? "any of the patterns" : "the pattern");
+    fprintf(file, "    without -g would. On a match it returns the index of the pattern in\n");
+    fprintf(file, "    %s_patterns, counting from 0 (pda itself numbers them from 1), and sets\n", name);
+    fprintf(file, "    *start and *matchLength; otherwise it returns -1.\n*/\n\n");
+    fprintf(file, "#include <stddef.h>\n#include <stdint.h>\n#include <string.h>\n");
+    fprintf(file, "#ifdef __SSE2__\n#include <emmintrin.h>\n#endif\n\n");
+    fprintf(file, "const char *const %s_patterns[%u] = {\n", name, prog->numPatterns);
+    for (uint32_t p = 0; p < prog->numPatterns; p++) {
+        fprintf(file, "    ");
+        emitString(file, patterns[p], strlen(patterns[p]));
+        fprintf(file, ",\n");
+    }
+    fprintf(file, "};\n\n");
+
+    fprintf(file, "static const uint8_t %s_classes[256] = {\n", name);
+    for (int ch = 0; ch < 256; ch++) {
+        fprintf(file, "%s%u,", ch % EMIT_ROW_VALUES == 0 ? "    " : " ", prog->byteClass[ch]);
+        if (ch % EMIT_ROW_VALUES == EMIT_ROW_VALUES - 1) {
+            fputc('\n', file);
+        }
+    }
+    fprintf(file, "};\n\n");
+    if (prog->prefilter.length > 0) {
+        emitFindPrefix(file, &prog->prefilter, name);
+    }
+    emitTable(file, name, "forward", forward, forwardIds, true, prog->numByteClasses);
+    emitTable(file, name, "reverse", reverse, NULL, false, 1);
+
+    // The lowest pattern starting where each reverse state is, or -1
+    fprintf(file, "static const int32_t %s_reversePattern[%zu] = {\n", name, reverse->numStates);
+    for (size_t i = 0; i < reverse->numStates; i++) {
+        const struct DFAState *ds = reverse->states[i];
+        int64_t pattern = -1;
+        for (size_t k = 0; k < ds->numNfaStates; k++) {
+            uint32_t state = ds->nfaStates[k];
+            if (prog->reverse->accept[state] && (pattern < 0 || prog->reverse->pattern[state] < pattern)) {
+                pattern = prog->reverse->pattern[state];
+            }
+        }
+        fprintf(file, "%s%lld,", i % EMIT_ROW_VALUES == 0 ? "    " : " ", (long long)pattern);
+        if (i % EMIT_ROW_VALUES == EMIT_ROW_VALUES - 1 || i == reverse->numStates - 1) {
+            fputc('\n', file);
+        }
+    }
+    fprintf(file, "};\n\n");
+
+    uint32_t numClasses = prog->numByteClasses;
+    fprintf(file, "int %s_search(const char *input, size_t length, size_t *start, size_t *matchLength) {\n", name);
+    fprintf(file, "    const unsigned char *in = (const unsigned char *)input;\n");
+    fprintf(file, "    size_t restart = 0, end = 0;\n");
+    fprintf(file, "    uint32_t s = 0;\n\n");
+    fprintf(file, "    // Scan for the earliest end, noting the last position with no partial match\n");
+    fprintf(file, "    for (size_t pos = 0; pos < length; pos++) {\n");
+    fprintf(file, "        if (s == 0) {\n");
+    if (prog->prefilter.length > 0) {
+        fprintf(file, "            pos += %s_findPrefix(in + pos, length - pos);\n", name);
+        fprintf(file, "            if (pos == length) {\n                return -1;\n            }\n");
+    }
+    fprintf(file, "            restart = pos;\n        }\n");
+    fprintf(file, "        s = %s_forward[s + %s_classes[in[pos]]];\n", name, name);
+    fprintf(file, "        if (s >= %u) {\n            end = pos + 1;\n            break;\n        }\n    }\n",
+            firstAccept * numClasses);
+    fprintf(file, "    if (s < %u) {\n        return -1;\n    }\n\n", firstAccept * numClasses);
+    fprintf(file, "    // Walk back for the leftmost start of a match ending there\n");
+    fprintf(file, "    int pattern = -1;\n");
+    fprintf(file, "    s = %u;\n", reverseStart->id);
+    fprintf(file, "    for (size_t pos = end; pos > restart && s != 0; pos--) {\n");
+    fprintf(file, "        s = %s_reverse[s * %u + %s_classes[in[pos - 1]]];\n", name, numClasses, name);
+    fprintf(file, "        if (%s_reversePattern[s] >= 0) {\n", name);
+    fprintf(file, "            pattern = %s_reversePattern[s];\n", name);
+    fprintf(file, "            *start = pos - 1;\n        }\n    }\n");
+    fprintf(file, "    *matchLength = end - *start;\n");
+    fprintf(file, "    return pattern;\n}\n");
+
+    free(forwardIds);
+    freeDFA(forward);
+    freeDFA(reverse);
+    return true;
+}
+
+// --------------------------------------------------------------------------- // 
+// --------------------------------------------------------------------------- // 
+
+/*
+    Library API
+
+    The interface declared in pda.h wraps a program, and a DFA and NFA scratch
+    space per thread. The program is never written to once compiled, so threads
+    only share what they read.
+*/
+
+struct PDARegex {
+    struct Program *prog;
+    bool greedy;
+};
+
+struct PDAScratch {
+    struct DFA *dfa;            // NULL for a literal set, which needs none
+    struct NFAScratch *nfa;
+};
+
+struct PDARegex *pdaCompile(const char *const *patterns, size_t numPatterns, unsigned flags, const char **error) {
+    if (numPatterns == 0) {
+        if (error) *error = "no patterns";
+        return NULL;
+    }
+    struct NFA *nfas = malloc(numPatterns * sizeof(struct NFA));
+    for (size_t p = 0; p < numPatterns; p++) {
+        nfas[p] = constructNFA(patterns[p], flags & PDA_CASELESS);
+        if (nfas[p].error) {
+            if (error) *error = nfas[p].error;
+            for (size_t q = 0; q < p; q++) {
+                freeNFA(&nfas[q]);
             }
-            case '*': {
-                assert(numStates > 1);
-                assert(!lastCharWasOperator);
-                lastCharWasOperator = true;
-                
-                if (lastWasGroup) {
-                    // Make the entire group repeat zero or more times
-                    size_t groupStart = groupStack[--stackTop];
-                    size_t groupEnd = numStates - 1;
-                    
-                    // Loop back: group end -> state right after group start
-                    for (size_t i = 0; i < states[groupStart].numTransitions; i++) {
-                        struct State *targetState = states[groupStart].transitions[i].next;
-                        struct Transition loopTr;
-                        if (states[groupStart].transitions[i].wildcard) {
-                            loopTr = newWildcardTransition(targetState);
-                        } else {
-                            loopTr = newTransition(states[groupStart].transitions[i].transitionChars, targetState);
-                        }
-                        addTransition(&states[groupEnd], loopTr);
-                    }
-                    // Add epsilon to skip the group entirely
-                    addTransition(&states[groupStart], newTransition("", &states[groupEnd]));
-                } else {
-                    // Make last character repeat zero or more times
-                    for (size_t i = 0; i < states[numStates-2].numTransitions; i++) {
-                        if (states[numStates-2].transitions[i].next == &states[numStates-1]) {
-                            states[numStates-2].transitions[i].next = &states[numStates-2];
-                            break;
-                        }
-                    }
-                    numStates--;
-                }
-                lastWasGroup = false;
+            free(nfas);
+            return NULL;
+        }
+    }
+
+    struct PDARegex *regex = malloc(sizeof(struct PDARegex));
+    regex->prog = compileNFA(nfas, numPatterns, flags & PDA_LINES);
+    regex->greedy = flags & PDA_GREEDY;
+    for (size_t p = 0; p < numPatterns; p++) {
+        freeNFA(&nfas[p]);
+    }
+    free(nfas);
+    return regex;
+}
+
+void pdaFree(struct PDARegex *regex) {
+    freeProgram(regex->prog);
+    free(regex);
+}
+
+struct PDAScratch *pdaNewScratch(const struct PDARegex *regex) {
+    struct PDAScratch *scratch = malloc(sizeof(struct PDAScratch));
+    scratch->dfa = regex->prog->literals ? NULL : newDFA(regex->prog, DFA_DEFAULT_CACHE_STATES);
+    scratch->nfa = newNFAScratch(regex->prog);
+    return scratch;
+}
+
+void pdaFreeScratch(struct PDAScratch *scratch) {
+    if (scratch->dfa) {
+        freeDFA(scratch->dfa);
+    }
+    freeNFAScratch(scratch->nfa);
+    free(scratch);
+}
+
+bool pdaSearch(const struct PDARegex *regex, struct PDAScratch *scratch, const char *buffer, size_t length,
+               size_t from, struct PDAMatch *match) {
+    struct MatchIterator it;
+    initMatchIterator(&it, regex->prog, scratch->dfa, scratch->nfa, buffer, length, true, regex->greedy);
+    it.offset = from;
+    struct Match m;
+    if (!nextMatch(&it, &m)) {
+        return false;
+    }
+    *match = (struct PDAMatch) { .start = m.start, .length = m.length, .pattern = m.pattern };
+    return true;
+}
+
+// --------------------------------------------------------------------------- // 
+// --------------------------------------------------------------------------- // 
+
+// The command line tool. Other programs built on the matcher, such as bench.c,
+// include this file with PDA_NO_MAIN defined.
+#ifndef PDA_NO_MAIN
+
+#define STREAM_CHUNK_SIZE (1 << 20)
+#define BINARY_CHECK_SIZE 4096
+
+static void printUsage(char *prog) {
+    fprintf(stderr, "Usage: %s [-g] [-i] [-r] [-j <threads>] [--dfa-cache <states>] <pattern> <filename>...\n", prog);
+    fprintf(stderr, "       %s [options] -e <pattern> [-e <pattern>...] [-f <patternfile>] <filename>...\n", prog);
+    fprintf(stderr, "       %s --build-index <index> <filename>\n", prog);
+    fprintf(stderr, "       %s [-i] --emit-c <name> <pattern>\n", prog);
+    fprintf(stderr, "  -g: Enable greedy matching (find longest match)\n");
+    fprintf(stderr, "  -i: Match letters in either case\n");
+    fprintf(stderr, "  -e: Search for this pattern, may be repeated\n");
+    fprintf(stderr, "  -f: Search for each pattern in this file, one per line\n");
+    fprintf(stderr, "  -n: Print each line holding a match, with its line number\n");
+    fprintf(stderr, "  -c: Print only the number of lines holding a match\n");
+    fprintf(stderr, "  -l: Print only the filename, if any line holds a match\n");
+    fprintf(stderr, "  -v: Select the lines without a match instead\n");
+    fprintf(stderr, "  -r: Search the files under each directory given, skipping binary files\n");
+    fprintf(stderr, "  -j: Search a regular file with this many threads (default 1), or several files\n");
+    fprintf(stderr, "      on this many threads (default one per processor)\n");
+    fprintf(stderr, "  --dfa-cache: Maximum number of cached DFA states (default %d, 0 disables the DFA)\n",
+            DFA_DEFAULT_CACHE_STATES);
+    fprintf(stderr, "  --cache: Keep compiled patterns in this directory for later runs\n");
+    fprintf(stderr, "  --build-index: Index the trigrams of a file, or bring its index up to date\n");
+    fprintf(stderr, "  --index: Only search the parts of the file this index cannot rule out\n");
+    fprintf(stderr, "  --emit-c: Print C source for <name>_search, which finds the matches without -g\n");
+    fprintf(stderr, "  --format: Print matches as text (default), tsv (start, length and pattern per line)\n");
+    fprintf(stderr, "            or binary (24-byte records of the same as little-endian 64-bit integers)\n");
+    fprintf(stderr, "  --stats: Report what the search did on stderr (needs a build with -DPDA_STATS)\n");
+    fprintf(stderr, "  A filename of - reads from standard input\n");
+}
+
+#ifdef PDA_STATS
+#include <time.h>
+
+static struct Stats totalStats;
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Adds what the calling thread has counted to the totals, and starts it over
+static void flushStats(void) {
+    pthread_mutex_lock(&statsLock);
+    uint64_t maxThreads = totalStats.maxThreads > threadStats.maxThreads ? totalStats.maxThreads
+                                                                         : threadStats.maxThreads;
+    // Every field is a uint64_t
+    uint64_t *total = (uint64_t *)&totalStats;
+    const uint64_t *counted = (const uint64_t *)&threadStats;
+    for (size_t i = 0; i < sizeof(struct Stats) / sizeof(uint64_t); i++) {
+        total[i] += counted[i];
+    }
+    totalStats.maxThreads = maxThreads;
+    pthread_mutex_unlock(&statsLock);
+    memset(&threadStats, 0, sizeof(struct Stats));
+}
+
+static double percent(uint64_t part, uint64_t whole) {
+    return whole > 0 ? 100.0 * (double)part / (double)whole : 0.0;
+}
+
+static void printStats(const struct Program *prog) {
+    static const char *engineNames[NUM_ENGINES] = {
+        "nfa:", "reverse nfa:", "dfa:", "bit-parallel:", "counters:", "literal set:"
+    };
+    const struct Stats *s = &totalStats;
+    uint64_t edges = prog->edgeStart[prog->numStates], epsilons = prog->epsilonStart[prog->numStates];
+
+    fprintf(stderr, "\nStatistics:\n");
+    if (s->cacheHits > 0) {
+        fprintf(stderr, "  compile:      %.3f ms, loaded from the pattern cache\n", s->compileNanos / 1e6);
+    } else {
+        fprintf(stderr, "  compile:      %.3f ms, %" PRIu64 " NFA states, %" PRIu64 " transitions added\n",
+                s->compileNanos / 1e6, s->nfaStates, s->nfaTransitions);
+    }
+    fprintf(stderr, "  program:      %u states, %" PRIu64 " edges, %" PRIu64 " epsilon edges, %u counters, "
+            "%u byte classes\n", prog->numStates, edges, epsilons, prog->numCounters, prog->numByteClasses);
+    fprintf(stderr, "  input:        %" PRIu64 " bytes in %.3f ms, %.1f MB/s\n", s->inputBytes,
+            s->searchNanos / 1e6, s->searchNanos > 0 ? s->inputBytes * 1e3 / s->searchNanos : 0.0);
+    for (int e = 0; e < NUM_ENGINES; e++) {
+        if (s->runs[e] > 0) {
+            fprintf(stderr, "  %-14s%" PRIu64 " runs over %" PRIu64 " bytes\n", engineNames[e], s->runs[e],
+                    s->bytes[e]);
+        }
+    }
+    if (s->threadSteps > 0) {
+        fprintf(stderr, "  threads:      %.1f active on average, %" PRIu64 " at most, %" PRIu64
+                " states reached through epsilon edges\n", (double)s->threads / s->threadSteps, s->maxThreads,
+                s->closureStates);
+    }
+    if (s->dfaHits + s->dfaMisses > 0) {
+        fprintf(stderr, "  dfa cache:    %.2f%% of %" PRIu64 " transitions cached, %" PRIu64 " flushes%s\n",
+                percent(s->dfaHits, s->dfaHits + s->dfaMisses), s->dfaHits + s->dfaMisses, s->dfaFlushes,
+                s->dfaGaveUp > 0 ? ", gave up thrashing" : "");
+    }
+    if (s->prefilterLookups > 0) {
+        fprintf(stderr, "  prefilter:    \"%.*s\" found by %.2f%% of %" PRIu64 " lookups, %.2f%% of input skipped\n",
+                (int)prog->prefilter.length, prog->prefilter.literal,
+                percent(s->prefilterCandidates, s->prefilterLookups), s->prefilterLookups,
+                percent(s->prefilterSkipped, s->inputBytes));
+    }
+    if (s->indexBlocks > 0) {
+        fprintf(stderr, "  index:        %" PRIu64 " of %" PRIu64 " blocks searched\n", s->indexCandidates,
+                s->indexBlocks);
+    }
+    fprintf(stderr, "  reallocs:     %" PRIu64 "\n", s->reallocs);
+}
+
+static uint64_t statsNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// Subtracting the start time and adding the end time leaves the time in between
+#define STAT_TIME_BEGIN(field) (threadStats.field -= statsNow())
+#define STAT_TIME_END(field) (threadStats.field += statsNow())
+#define STAT_FLUSH() flushStats()
+#define STAT_REPORT(prog) printStats(prog)
+#else
+#define STAT_TIME_BEGIN(field) ((void)0)
+#define STAT_TIME_END(field) ((void)0)
+#define STAT_FLUSH() ((void)0)
+#define STAT_REPORT(prog) ((void)0)
+#endif
+
+#define OUTPUT_BUFFER_SIZE (1 << 16)
+
+enum OutputFormat { FORMAT_TEXT, FORMAT_TSV, FORMAT_BINARY };
+
+struct Output {
+    int matchCount;         // Matches, or in line mode the lines selected
+    bool showPattern;       // Say which pattern matched, when there are several
+    enum OutputFormat format;
+
+    // Everything printed per match or line is gathered here and written to stdout
+    // in large blocks. When capturing, the buffer grows to hold the whole output
+    // instead, to be written out later.
+    char *buffer;
+    size_t buffered;
+    bool capture;
+    size_t capacity;
+    const char *filename;   // Printed before each line or record, when searching several files
+
+    // Line mode (-n, -c, -l, -v) reports whole lines instead of matches
+    bool lineMode;
+    bool lineNumbers;
+    bool countOnly;
+    bool filesOnly;
+    bool invert;            // Select the lines without a match
+    size_t nextLine;        // Position of the first line not yet accounted for
+    size_t lineNumber;      // Number of the line at nextLine
+};
+
+// Must be called before anything is printed to stdout other than through out
+static void flushOutput(struct Output *out) {
+    if (out->capture) {
+        return;
+    }
+    fwrite(out->buffer, 1, out->buffered, stdout);
+    out->buffered = 0;
+}
+
+static void outputBytes(struct Output *out, const void *data, size_t length) {
+    if (out->capture && out->buffered + length > out->capacity) {
+        out->capacity = 2 * (out->buffered + length);
+        STAT_ADD(reallocs, 1);
+        out->buffer = realloc(out->buffer, out->capacity);
+    } else if (!out->capture && out->buffered + length > OUTPUT_BUFFER_SIZE) {
+        flushOutput(out);
+        // Too large to be worth copying
+        if (length > OUTPUT_BUFFER_SIZE) {
+            fwrite(data, 1, length, stdout);
+            return;
+        }
+    }
+    memcpy(out->buffer + out->buffered, data, length);
+    out->buffered += length;
+}
+
+static void outputString(struct Output *out, const char *text) {
+    outputBytes(out, text, strlen(text));
+}
+
+static void outputNumber(struct Output *out, uint64_t n) {
+    char digits[20];
+    size_t i = sizeof(digits);
+    do {
+        digits[--i] = (char)('0' + n % 10);
+        n /= 10;
+    } while (n > 0);
+    outputBytes(out, digits + i, sizeof(digits) - i);
+}
+
+// text points at the matched bytes, which are copied straight from the input
+static void printMatch(struct Output *out, const char *text, const struct Match *m) {
+    out->matchCount++;
+    if (out->format == FORMAT_TSV) {
+        if (out->filename) {
+            outputString(out, out->filename);
+            outputBytes(out, "\t", 1);
+        }
+        outputNumber(out, m->start);
+        outputBytes(out, "\t", 1);
+        outputNumber(out, m->length);
+        outputBytes(out, "\t", 1);
+        outputNumber(out, m->pattern + 1);
+        outputBytes(out, "\n", 1);
+    } else if (out->format == FORMAT_BINARY) {
+        uint64_t fields[3] = { m->start, m->length, m->pattern + 1 };
+        unsigned char record[24];
+        for (int f = 0; f < 3; f++) {
+            for (int b = 0; b < 8; b++) {
+                record[8 * f + b] = (unsigned char)(fields[f] >> (8 * b));
+            }
+        }
+        outputBytes(out, record, sizeof(record));
+    } else {
+        outputString(out, "Match #");
+        outputNumber(out, (uint64_t)out->matchCount);
+        outputString(out, " at index ");
+        outputNumber(out, m->start);
+        if (out->showPattern) {
+            outputString(out, " (pattern ");
+            outputNumber(out, m->pattern + 1);
+            outputBytes(out, ")", 1);
+        }
+        outputString(out, ": \"");
+        outputBytes(out, text, m->length);
+        outputString(out, "\"\n");
+    }
+}
+
+// Prints every match the iterator can find in its current buffer
+static void printMatches(struct MatchIterator *it, struct Output *out) {
+    struct Match m;
+    while (nextMatch(it, &m)) {
+        printMatch(out, it->input + (m.start - it->base), &m);
+    }
+}
+
+// Whether -l has already seen enough
+static bool outputDone(const struct Output *out) {
+    return out->filesOnly && out->matchCount > 0;
+}
+
+static void printLine(struct Output *out, const char *text, size_t length) {
+    if (out->filename) {
+        outputString(out, out->filename);
+        outputBytes(out, ":", 1);
+    }
+    if (out->lineNumbers) {
+        outputNumber(out, out->lineNumber);
+        outputBytes(out, ":", 1);
+    }
+    outputBytes(out, text, length);
+    outputBytes(out, "\n", 1);
+}
+
+/*
+    Accounts for the lines from out->nextLine up to end, none of which holds a
+    match. end must be the start of a line or the end of the input, and input
+    holds the stream from position base on. Unless they are printed, the lines are
+    only counted, and only if anything needs the count.
+*/
+static void skipLines(struct Output *out, const char *input, size_t base, size_t end) {
+    if (out->nextLine >= end) {
+        return;
+    }
+    const char *text = input + (out->nextLine - base);
+    size_t length = end - out->nextLine;
+    out->nextLine = end;
+
+    if (out->invert && !out->countOnly && !out->filesOnly) {
+        const char *stop = text + length;
+        while (text < stop) {
+            const char *newline = memchr(text, '\n', (size_t)(stop - text));
+            const char *lineEnd = newline ? newline : stop;
+            printLine(out, text, (size_t)(lineEnd - text));
+            out->matchCount++;
+            out->lineNumber++;
+            text = lineEnd + 1;
+        }
+    } else if (out->invert || out->lineNumbers) {
+        // A last line without a newline still counts
+        size_t lines = countNewlines(text, length) + (text[length - 1] != '\n');
+        out->lineNumber += lines;
+        if (out->invert) {
+            out->matchCount += (int)lines;
+        }
+    }
+}
+
+// Reports a line holding a match, given as by nextMatchingLine
+static void reportLine(struct Output *out, const char *input, size_t base, const struct Match *line) {
+    skipLines(out, input, base, line->start);
+    if (!out->invert) {
+        out->matchCount++;
+        if (!out->countOnly && !out->filesOnly) {
+            printLine(out, input + (line->start - base), line->length);
+        }
+    }
+    out->lineNumber++;
+    out->nextLine = line->start + line->length + 1;
+}
+
+// Reports the lines of the iterator's current buffer, which must be final and
+// end at the end of a line
+static void printLines(struct MatchIterator *it, struct Output *out) {
+    struct Match line;
+    while (!outputDone(out) && nextMatchingLine(it, &line)) {
+        reportLine(out, it->input, it->base, &line);
+    }
+    if (!outputDone(out)) {
+        skipLines(out, it->input, it->base, it->base + it->length);
+    }
+}
+
+/*
+    Decompression
+
+    Input that starts with the magic bytes of gzip or zstd is searched as the data
+    it decompresses to, in a build with -DPDA_ZLIB (linked with -lz) or -DPDA_ZSTD
+    (-lzstd). A thread of its own decompresses it into a ring of RING_BLOCKS blocks,
+    and searchStream reads from the ring while the blocks after it are filled, so
+    decompression and matching overlap. As the stream is searched in chunks either
+    way, matches are found across block boundaries and at their position in the
+    decompressed data.
+
+    The ring has one producer and one consumer. Each side counts the blocks it is
+    done with and publishes that count with a store only it makes, so handing over
+    a block takes no lock. A side only locks to sleep when the ring is full or
+    empty, after flagging that it waits; the other side checks the flag after each
+    store and wakes it.
+*/
+
+#define MAGIC_SIZE 4
+#define RING_BLOCKS 8
+#define RING_BLOCK_SIZE (256 * 1024)
+#define COMPRESSED_READ_SIZE (128 * 1024)
+
+enum Compression { COMPRESSION_NONE, COMPRESSION_GZIP, COMPRESSION_ZSTD };
+
+struct Decompressor;
+
+// What searchStream reads: a file descriptor, starting with any bytes already read
+// from it to look for magic bytes, or the output of a decompressor
+struct StreamSource {
+    int fd;
+    unsigned char head[MAGIC_SIZE];
+    size_t headLength;
+    struct Decompressor *decompressor;  // Read instead of fd when not NULL
+};
+
+struct Decompressor {
+    enum Compression compression;
+    const unsigned char *mapped;    // The compressed input, or NULL to read it from source
+    size_t mappedSize;
+    size_t mappedOffset;
+    struct StreamSource *source;
+    unsigned char *input;           // COMPRESSED_READ_SIZE bytes, when reading from source
+
+    // Block i is at blocks + (i % RING_BLOCKS) * RING_BLOCK_SIZE and holds
+    // lengths[i % RING_BLOCKS] bytes. produced is only written by the decompressing
+    // thread and consumed only by the reader.
+    char *blocks;
+    size_t lengths[RING_BLOCKS];
+    size_t produced;
+    size_t consumed;
+    size_t readOffset;              // Into the block being consumed
+    bool finished;                  // No more blocks will be produced
+    bool failed;                    // The input could not be read or is not valid
+    bool cancelled;                 // The reader has stopped
+    bool producerWaiting;
+    bool consumerWaiting;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_t thread;
+};
+
+static enum Compression detectCompression(const unsigned char *head, size_t length) {
+    if (length >= 2 && head[0] == 0x1f && head[1] == 0x8b) {
+        return COMPRESSION_GZIP;
+    }
+    if (length >= 4 && memcmp(head, "\x28\xb5\x2f\xfd", 4) == 0) {
+        return COMPRESSION_ZSTD;
+    }
+    return COMPRESSION_NONE;
+}
+
+static bool canDecompress(enum Compression compression) {
+#ifdef PDA_ZLIB
+    if (compression == COMPRESSION_GZIP) {
+        return true;
+    }
+#endif
+#ifdef PDA_ZSTD
+    if (compression == COMPRESSION_ZSTD) {
+        return true;
+    }
+#endif
+    (void)compression;
+    return false;
+}
+
+// Reads the first bytes of fd into source->head, as many as there are up to
+// MAGIC_SIZE. Returns false if fd could not be read.
+static bool readHead(struct StreamSource *source) {
+    while (source->headLength < MAGIC_SIZE) {
+        ssize_t n = read(source->fd, source->head + source->headLength, MAGIC_SIZE - source->headLength);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return n == 0;
+        }
+        source->headLength += (size_t)n;
+    }
+    return true;
+}
+
+// Reads as read(2) does from source->fd, giving out source->head first
+static ssize_t readRaw(struct StreamSource *source, void *buffer, size_t size) {
+    if (source->headLength == 0) {
+        return read(source->fd, buffer, size);
+    }
+    size_t n = source->headLength < size ? source->headLength : size;
+    memcpy(buffer, source->head, n);
+    memmove(source->head, source->head + n, source->headLength - n);
+    source->headLength -= n;
+    return (ssize_t)n;
+}
+
+static bool ringHasBlock(struct Decompressor *dec) {
+    return __atomic_load_n(&dec->produced, __ATOMIC_SEQ_CST) > dec->consumed ||
+           __atomic_load_n(&dec->finished, __ATOMIC_SEQ_CST);
+}
+
+// Sleeps until ready holds, with *waiting set meanwhile so the other side wakes it
+static void ringWait(struct Decompressor *dec, bool *waiting, bool (*ready)(struct Decompressor *)) {
+    if (ready(dec)) {
+        return;
+    }
+    pthread_mutex_lock(&dec->lock);
+    __atomic_store_n(waiting, true, __ATOMIC_SEQ_CST);
+    while (!ready(dec)) {
+        pthread_cond_wait(&dec->changed, &dec->lock);
+    }
+    __atomic_store_n(waiting, false, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&dec->lock);
+}
+
+// Wakes the other side if it sleeps in ringWait. Called after the store that
+// makes it ready, which it then cannot miss: either it sees the store before it
+// sleeps, or this sees *waiting.
+static void ringWake(struct Decompressor *dec, bool *waiting) {
+    if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&dec->lock);
+        pthread_cond_broadcast(&dec->changed);
+        pthread_mutex_unlock(&dec->lock);
+    }
+}
+
+#if defined(PDA_ZLIB) || defined(PDA_ZSTD)
+static bool ringHasSpace(struct Decompressor *dec) {
+    return __atomic_load_n(&dec->produced, __ATOMIC_SEQ_CST) - __atomic_load_n(&dec->consumed, __ATOMIC_SEQ_CST) <
+               RING_BLOCKS ||
+           __atomic_load_n(&dec->cancelled, __ATOMIC_SEQ_CST);
+}
+
+// Waits for an empty block to decompress into. Returns NULL once the reader has
+// stopped.
+static char *ringNextBlock(struct Decompressor *dec) {
+    ringWait(dec, &dec->producerWaiting, ringHasSpace);
+    if (__atomic_load_n(&dec->cancelled, __ATOMIC_SEQ_CST)) {
+        return NULL;
+    }
+    return dec->blocks + (dec->produced % RING_BLOCKS) * RING_BLOCK_SIZE;
+}
+
+// Hands the block from ringNextBlock to the reader, holding length bytes
+static void ringPublish(struct Decompressor *dec, size_t length) {
+    dec->lengths[dec->produced % RING_BLOCKS] = length;
+    __atomic_store_n(&dec->produced, dec->produced + 1, __ATOMIC_SEQ_CST);
+    ringWake(dec, &dec->consumerWaiting);
+}
+
+// Points *data at the next bytes of compressed input and returns how many there
+// are, 0 at its end or -1 if it could not be read
+static ssize_t nextCompressed(struct Decompressor *dec, const unsigned char **data) {
+    if (dec->mapped) {
+        size_t n = dec->mappedSize - dec->mappedOffset;
+        n = n < COMPRESSED_READ_SIZE ? n : COMPRESSED_READ_SIZE;
+        *data = dec->mapped + dec->mappedOffset;
+        dec->mappedOffset += n;
+        return (ssize_t)n;
+    }
+    ssize_t n;
+    do {
+        n = readRaw(dec->source, dec->input, COMPRESSED_READ_SIZE);
+    } while (n < 0 && errno == EINTR);
+    *data = dec->input;
+    return n;
+}
+#endif
+
+#ifdef PDA_ZLIB
+// Inflates gzip input into the ring, one member after another as gzip does
+static bool inflateGzip(struct Decompressor *dec) {
+    z_stream z = {0};
+    if (inflateInit2(&z, 15 + 16) != Z_OK) {
+        return false;
+    }
+    bool ok = true;
+    bool inMember = false;      // Whether a member has begun and not yet ended
+    bool needInput = true;      // Whether inflate has written out all it can
+    bool padding = false;       // Whether only zero bytes may follow, as after the last member
+    char *block = NULL;
+    while (true) {
+        if (z.avail_in == 0 && needInput) {
+            const unsigned char *data;
+            ssize_t n = nextCompressed(dec, &data);
+            if (n <= 0) {
+                ok = n == 0 && !inMember;
                 break;
             }
-            case '+': {
-                assert(numStates > 1);
-                assert(!lastCharWasOperator);
-                lastCharWasOperator = true;
-                
-                if (lastWasGroup) {
-                    // Make the entire group repeat one or more times
-                    size_t groupStart = groupStack[--stackTop];
-                    size_t groupEnd = numStates - 1;
-                    
-                    // Loop back: group end -> state right after group start
-                    for (size_t i = 0; i < states[groupStart].numTransitions; i++) {
-                        struct State *targetState = states[groupStart].transitions[i].next;
-                        struct Transition loopTr;
-                        if (states[groupStart].transitions[i].wildcard) {
-                            loopTr = newWildcardTransition(targetState);
-                        } else {
-                            loopTr = newTransition(states[groupStart].transitions[i].transitionChars, targetState);
-                        }
-                        addTransition(&states[groupEnd], loopTr);
-                    }
-                } else {
-                    // Make last character repeat one or more times
-                    // Check if the transition TO the current state is a wildcard
-                    bool lastWasWildcard = false;
-                    if (numStates >= 2) {
-                        for (size_t i = 0; i < states[numStates-2].numTransitions; i++) {
-                            if (states[numStates-2].transitions[i].next == &states[numStates-1] &&
-                                states[numStates-2].transitions[i].wildcard) {
-                                lastWasWildcard = true;
-                                break;
-                            }
-                        }
-                    }
-                    
-                    if (lastWasWildcard) {
-                        addTransition(&states[numStates-1], newWildcardTransition(&states[numStates-1]));
-                    } else {
-                        char pch[2] = {*(c-1), '\0'};
-                        addTransition(&states[numStates-1], newTransition(pch, &states[numStates-1]));
-                    }
-                }
-                lastWasGroup = false;
+            z.next_in = (Bytef *)data;
+            z.avail_in = (uInt)n;
+        }
+
+        // A member starts with magic bytes, so a zero byte where the next one would
+        // start begins padding, as tape and block-padded writers leave and gzip -d
+        // accepts. Nothing but zero bytes may follow it.
+        padding = padding || (!inMember && z.avail_in > 0 && z.next_in[0] == 0);
+        if (padding) {
+            for (uInt i = 0; i < z.avail_in && ok; i++) {
+                ok = z.next_in[i] == 0;
+            }
+            if (!ok) {
                 break;
             }
-            case '\\': {
-                c++;
-                if (!*c) {
-                    // Backslash at end of pattern - treat as literal backslash
-                    if (maxStates == numStates) {
-                        maxStates += 16;
-                        states = realloc(states, sizeof(struct State)*maxStates);
-                    }
-                    states[numStates] = newState(false);
-                    char ch[2] = {'\\', '\0'};
-                    addTransition(&states[numStates-1], newTransition(ch, &states[numStates]));
-                    numStates++;
-                    lastWasGroup = false;
-                    lastCharWasOperator = false;
-                    break;
-                }
-                // fallthrough to literal character case (for operator characters)
-                __attribute__((fallthrough));
+            z.avail_in = 0;
+            continue;
+        }
+        if (!block) {
+            block = ringNextBlock(dec);
+            if (!block) {
+                break;
             }
-            default: {
-                // Create transition with this character to new state
-                if (maxStates == numStates) {
-                    maxStates += 16;
-                    states = realloc(states, sizeof(struct State)*maxStates);
+            z.next_out = (Bytef *)block;
+            z.avail_out = RING_BLOCK_SIZE;
+        }
+        inMember = inMember || z.avail_in > 0;
+        int result = inflate(&z, Z_NO_FLUSH);
+        if (result == Z_STREAM_END) {
+            // Another member may follow, and this one has been written out in full
+            inMember = false;
+            inflateReset(&z);
+        } else if (result != Z_OK && result != Z_BUF_ERROR) {
+            ok = false;
+            break;
+        }
+        needInput = z.avail_out > 0 || result == Z_STREAM_END;
+        if (z.avail_out == 0) {
+            ringPublish(dec, RING_BLOCK_SIZE);
+            block = NULL;
+        }
+    }
+    if (block && z.avail_out < RING_BLOCK_SIZE) {
+        ringPublish(dec, RING_BLOCK_SIZE - z.avail_out);
+    }
+    inflateEnd(&z);
+    return ok;
+}
+#endif
+
+#ifdef PDA_ZSTD
+// Decompresses zstd input into the ring, frame after frame
+static bool decompressZstd(struct Decompressor *dec) {
+    ZSTD_DCtx *context = ZSTD_createDCtx();
+    if (!context) {
+        return false;
+    }
+    ZSTD_inBuffer in = {0};
+    ZSTD_outBuffer out = {0};
+    bool ok = true;
+    bool inFrame = false;       // Whether a frame has begun and not yet ended
+    bool needInput = true;      // Whether the decoder has written out all it can
+    while (true) {
+        if (in.pos == in.size && needInput) {
+            const unsigned char *data;
+            ssize_t n = nextCompressed(dec, &data);
+            if (n <= 0) {
+                ok = n == 0 && !inFrame;
+                break;
+            }
+            in = (ZSTD_inBuffer){ .src = data, .size = (size_t)n, .pos = 0 };
+        }
+        if (!out.dst) {
+            char *block = ringNextBlock(dec);
+            if (!block) {
+                break;
+            }
+            out = (ZSTD_outBuffer){ .dst = block, .size = RING_BLOCK_SIZE, .pos = 0 };
+        }
+        inFrame = inFrame || in.pos < in.size;
+        size_t hint = ZSTD_decompressStream(context, &out, &in);
+        if (ZSTD_isError(hint)) {
+            ok = false;
+            break;
+        }
+        // 0 once a frame has been written out in full; another one may follow
+        if (hint == 0) {
+            inFrame = false;
+        }
+        needInput = out.pos < out.size || hint == 0;
+        if (out.pos == out.size) {
+            ringPublish(dec, RING_BLOCK_SIZE);
+            out.dst = NULL;
+        }
+    }
+    if (out.dst && out.pos > 0) {
+        ringPublish(dec, out.pos);
+    }
+    ZSTD_freeDCtx(context);
+    return ok;
+}
+#endif
+
+static void *decompressWorker(void *arg) {
+    struct Decompressor *dec = arg;
+    bool ok = false;
+#ifdef PDA_ZLIB
+    if (dec->compression == COMPRESSION_GZIP) {
+        ok = inflateGzip(dec);
+    }
+#endif
+#ifdef PDA_ZSTD
+    if (dec->compression == COMPRESSION_ZSTD) {
+        ok = decompressZstd(dec);
+    }
+#endif
+    __atomic_store_n(&dec->failed, !ok, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&dec->finished, true, __ATOMIC_SEQ_CST);
+    ringWake(dec, &dec->consumerWaiting);
+    return NULL;
+}
+
+// Starts decompressing the input, which is mapped, or else read from source
+static struct Decompressor *startDecompressor(enum Compression compression, const char *mapped,
+                                              size_t mappedSize, struct StreamSource *source) {
+    struct Decompressor *dec = calloc(1, sizeof(struct Decompressor));
+    dec->compression = compression;
+    dec->mapped = (const unsigned char *)mapped;
+    dec->mappedSize = mappedSize;
+    dec->source = source;
+    dec->input = mapped ? NULL : malloc(COMPRESSED_READ_SIZE);
+    dec->blocks = malloc((size_t)RING_BLOCKS * RING_BLOCK_SIZE);
+    pthread_mutex_init(&dec->lock, NULL);
+    pthread_cond_init(&dec->changed, NULL);
+    pthread_create(&dec->thread, NULL, decompressWorker, dec);
+    return dec;
+}
+
+// Reads as read(2) does, from what has been decompressed so far
+static ssize_t readDecompressed(struct Decompressor *dec, void *buffer, size_t size) {
+    ringWait(dec, &dec->consumerWaiting, ringHasBlock);
+    size_t consumed = dec->consumed;
+    if (__atomic_load_n(&dec->produced, __ATOMIC_SEQ_CST) == consumed) {
+        return __atomic_load_n(&dec->failed, __ATOMIC_SEQ_CST) ? -1 : 0;
+    }
+    size_t length = dec->lengths[consumed % RING_BLOCKS];
+    size_t n = length - dec->readOffset < size ? length - dec->readOffset : size;
+    memcpy(buffer, dec->blocks + (consumed % RING_BLOCKS) * RING_BLOCK_SIZE + dec->readOffset, n);
+    dec->readOffset += n;
+    if (dec->readOffset == length) {
+        dec->readOffset = 0;
+        __atomic_store_n(&dec->consumed, consumed + 1, __ATOMIC_SEQ_CST);
+        ringWake(dec, &dec->producerWaiting);
+    }
+    return (ssize_t)n;
+}
+
+// Whether the decompressed data has a NUL byte near its start
+static bool decompressedBinary(struct Decompressor *dec) {
+    ringWait(dec, &dec->consumerWaiting, ringHasBlock);
+    if (__atomic_load_n(&dec->produced, __ATOMIC_SEQ_CST) == 0) {
+        return false;
+    }
+    size_t length = dec->lengths[0] < BINARY_CHECK_SIZE ? dec->lengths[0] : BINARY_CHECK_SIZE;
+    return memchr(dec->blocks, '\0', length) != NULL;
+}
+
+// Stops the decompressing thread and frees the decompressor. Returns whether all
+// of the input that was decompressed was valid.
+static bool stopDecompressor(struct Decompressor *dec) {
+    __atomic_store_n(&dec->cancelled, true, __ATOMIC_SEQ_CST);
+    ringWake(dec, &dec->producerWaiting);
+    pthread_join(dec->thread, NULL);
+    bool ok = !dec->failed;
+    pthread_mutex_destroy(&dec->lock);
+    pthread_cond_destroy(&dec->changed);
+    free(dec->input);
+    free(dec->blocks);
+    free(dec);
+    return ok;
+}
+
+static ssize_t readSource(struct StreamSource *source, void *buffer, size_t size) {
+    return source->decompressor ? readDecompressed(source->decompressor, buffer, size)
+                                : readRaw(source, buffer, size);
+}
+
+/*
+    Searches a pipe, terminal, decompressed or other unmappable input in chunks. The bytes a match
+    may still need are carried over into the next chunk, and before resuming at
+    least as many new bytes are read as were carried over, so input that keeps a
+    partial match alive for a long time is still only rescanned a bounded number
+    of times. In line mode only complete lines are searched, each chunk as final
+    input since no match crosses into the next line, and the partial last line is
+    carried over.
+*/
+static bool searchStream(struct StreamSource *source, struct MatchIterator *it, struct Output *out) {
+    size_t capacity = STREAM_CHUNK_SIZE;
+    char *buffer = malloc(capacity);
+    size_t length = 0;
+    bool eof = false;
+    
+    while (!eof && !outputDone(out)) {
+        size_t keep = length - it->offset;
+        memmove(buffer, buffer + it->offset, keep);
+        length = keep;
+        if (capacity < keep + STREAM_CHUNK_SIZE || capacity < 2 * keep) {
+            capacity = keep + (keep > STREAM_CHUNK_SIZE ? keep : STREAM_CHUNK_SIZE);
+            STAT_ADD(reallocs, 1);
+            buffer = realloc(buffer, capacity);
+        }
+        
+        // Write out what has been found before waiting for more input
+        flushOutput(out);
+        while (!eof && (length == keep || length - keep < keep)) {
+            ssize_t n = readSource(source, buffer + length, capacity - length);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
                 }
-                states[numStates] = newState(false);
-                char ch[2] = {*c, '\0'};
-                addTransition(&states[numStates-1], newTransition(ch, &states[numStates]));
-                numStates++;
-                lastWasGroup = false;
-                lastCharWasOperator = false;
+                free(buffer);
+                return false;
+            }
+            eof = n == 0;
+            length += n;
+            STAT_ADD(inputBytes, n);
+        }
+        
+        if (out->lineMode) {
+            const char *lastNewline = eof ? NULL : memrchr(buffer, '\n', length);
+            size_t lines = eof ? length : lastNewline ? (size_t)(lastNewline - buffer) + 1 : 0;
+            refillMatchIterator(it, buffer, lines, true);
+            printLines(it, out);
+        } else {
+            refillMatchIterator(it, buffer, length, eof);
+            printMatches(it, out);
+        }
+    }
+    
+    free(buffer);
+    return true;
+}
+
+/*
+    Parallel search (-j)
+
+    A mapped file is split on newline boundaries into more chunks than there are
+    workers. Each worker takes chunks off a shared counter and collects the matches
+    that start inside the chunk, searching from the chunk start as if no match had
+    come before it. Those lists are merged in file order afterwards.
+
+    A worker's list is exactly what a sequential search would report as long as the
+    previous chunk's last match ended before the chunk starts. When a match crosses
+    into the chunk, the merge rescans from where that match ended until the
+    sequential search produces a match the worker also found: from there on both
+    searches continue from the same position and the rest of the list is used as is.
+
+    A worker does not read past its chunk. If it cannot tell whether a match ends
+    within the chunk, it stops there and the merge takes over from where it stopped.
+    The merge runs a single sequential search over the whole buffer, which skips
+    ahead whenever it is in step with a worker again and keeps a match found past
+    the chunk it was looked for in, so no byte is searched by it twice and -j costs
+    at most one sequential pass on top of the workers.
+
+    In line mode no match crosses a line, so the workers search their chunks as
+    final input and collect the matching lines, and the merge needs no rescan. Line
+    numbers are counted during the merge.
+*/
+
+#define CHUNKS_PER_WORKER 4
+
+struct SearchChunk {
+    size_t start, end;
+    struct Match *matches;
+    size_t numMatches;
+    bool complete;          // Whether the worker searched the whole chunk
+    size_t resume;          // Where the worker's search would resume, if not
+};
+
+struct ParallelSearch {
+    const struct Program *prog;
+    const char *buffer;
+    size_t size;
+    bool greedy;
+    bool lineMode;
+    bool firstLineOnly;     // Only whether there is a matching line matters
+    bool found;             // Set once a matching line is found, if firstLineOnly
+    size_t dfaCacheStates;
+    struct SearchChunk *chunks;
+    size_t numChunks;
+    size_t nextChunk;       // Shared by the workers, taken with an atomic increment
+};
+
+static void *searchWorker(void *arg) {
+    struct ParallelSearch *ps = arg;
+    struct DFA *dfa = ps->dfaCacheStates > 0 ? newDFA(ps->prog, ps->dfaCacheStates) : NULL;
+    struct NFAScratch *scratch = newNFAScratch(ps->prog);
+
+    size_t index;
+    while ((index = __atomic_fetch_add(&ps->nextChunk, 1, __ATOMIC_RELAXED)) < ps->numChunks &&
+           !__atomic_load_n(&ps->found, __ATOMIC_RELAXED)) {
+        struct SearchChunk *chunk = &ps->chunks[index];
+        size_t maxMatches = 16;
+        chunk->matches = malloc(maxMatches * sizeof(struct Match));
+        chunk->numMatches = 0;
+
+        // The chunk is the end of the input, unless it is searched for matches that
+        // may run on past it
+        struct MatchIterator it;
+        struct Match m;
+        initMatchIterator(&it, ps->prog, dfa, scratch, ps->buffer, chunk->end,
+                          ps->lineMode || chunk->end == ps->size, ps->greedy && !ps->lineMode);
+        it.offset = chunk->start;
+        while (ps->lineMode ? nextMatchingLine(&it, &m) : nextMatch(&it, &m)) {
+            if (chunk->numMatches == maxMatches) {
+                maxMatches *= 2;
+                STAT_ADD(reallocs, 1);
+                chunk->matches = realloc(chunk->matches, maxMatches * sizeof(struct Match));
+            }
+            chunk->matches[chunk->numMatches++] = m;
+            if (ps->firstLineOnly) {
+                __atomic_store_n(&ps->found, true, __ATOMIC_RELAXED);
                 break;
             }
         }
+        chunk->resume = it.base + it.offset;
+        chunk->complete = it.final || chunk->resume >= chunk->end;
+    }
+
+    if (dfa) {
+        freeDFA(dfa);
+    }
+    freeNFAScratch(scratch);
+    STAT_FLUSH();
+    return NULL;
+}
+
+// The sequential search the merge runs wherever a worker's list cannot be used
+struct MergeSearch {
+    struct MatchIterator it;    // Over the whole buffer
+    size_t origin;              // Where the search resumes
+    struct Match pending;       // Found starting past the chunk it was looked for in
+    bool hasPending;
+};
+
+// Moves the search ahead to where a worker's search it is in step with resumes
+static void mergeSkipTo(struct MergeSearch *ms, size_t origin) {
+    ms->origin = origin;
+    ms->it.offset = origin;
+    ms->hasPending = false;
+}
+
+/*
+    Continues the sequential search over the matches that start in the chunk,
+    printing each until it finds one the worker found as well. Returns where that
+    match is in the worker's list, or the length of the list if there is none. A
+    match starting past the chunk is kept for the next one.
+*/
+static size_t rescanChunk(struct MergeSearch *ms, const struct SearchChunk *chunk, const char *buffer,
+                          struct Output *out) {
+    size_t w = 0;
+    while (ms->origin < chunk->end) {
+        struct Match m;
+        if (ms->hasPending) {
+            m = ms->pending;
+            ms->hasPending = false;
+        } else if (!nextMatch(&ms->it, &m)) {
+            // No match follows anywhere
+            ms->origin = ms->it.length;
+            break;
+        }
+        if (m.start >= chunk->end) {
+            ms->pending = m;
+            ms->hasPending = true;
+            ms->origin = m.start;
+            break;
+        }
+        while (w < chunk->numMatches && chunk->matches[w].start < m.start) {
+            w++;
+        }
+        if (w < chunk->numMatches && chunk->matches[w].start == m.start &&
+            chunk->matches[w].length == m.length && chunk->matches[w].pattern == m.pattern) {
+            return w;
+        }
+        printMatch(out, buffer + m.start, &m);
+        ms->origin = m.start + m.length;
+    }
+    return chunk->numMatches;
+}
+
+static void searchParallel(const struct Program *prog, struct DFA *dfa, struct NFAScratch *scratch, const char *buffer,
+                           size_t size, bool greedy, size_t dfaCacheStates, int numWorkers, struct Output *out) {
+    struct ParallelSearch ps = {
+        .prog = prog,
+        .buffer = buffer,
+        .size = size,
+        .greedy = greedy,
+        .lineMode = out->lineMode,
+        .firstLineOnly = out->filesOnly && !out->invert,
+        .found = false,
+        .dfaCacheStates = dfaCacheStates,
+        .chunks = malloc(numWorkers * CHUNKS_PER_WORKER * sizeof(struct SearchChunk)),
+        .numChunks = 0,
+        .nextChunk = 0
+    };
+
+    // Split after the first newline past each evenly spaced cut
+    size_t target = numWorkers * CHUNKS_PER_WORKER;
+    size_t chunkStart = 0;
+    for (size_t i = 1; i <= target && chunkStart < size; i++) {
+        size_t chunkEnd = size;
+        if (i < target && size / target * i > chunkStart) {
+            const char *newline = memchr(buffer + size / target * i, '\n', size - size / target * i);
+            chunkEnd = newline ? (size_t)(newline - buffer) + 1 : size;
+        }
+        if (chunkEnd > chunkStart) {
+            ps.chunks[ps.numChunks++] = (struct SearchChunk) { .start = chunkStart, .end = chunkEnd };
+            chunkStart = chunkEnd;
+        }
+    }
+
+    pthread_t *threads = malloc(numWorkers * sizeof(pthread_t));
+    for (int i = 0; i < numWorkers; i++) {
+        pthread_create(&threads[i], NULL, searchWorker, &ps);
+    }
+    for (int i = 0; i < numWorkers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    if (out->lineMode) {
+        for (size_t c = 0; c < ps.numChunks; c++) {
+            struct SearchChunk *chunk = &ps.chunks[c];
+            for (size_t i = 0; i < chunk->numMatches && !outputDone(out); i++) {
+                reportLine(out, buffer, 0, &chunk->matches[i]);
+            }
+            free(chunk->matches);
+        }
+        if (!outputDone(out)) {
+            skipLines(out, buffer, 0, size);
+        }
+        free(ps.chunks);
+        return;
     }
-    
-    free(groupStack);
-    states = realloc(states, sizeof(struct State)*numStates);
-    states[numStates-1].accept = true;
-    return (struct NFA) {
-        .numStates = numStates,
-        .states = states
+
+    // Merge in file order
+    struct MergeSearch ms = { .origin = 0, .hasPending = false };
+    initMatchIterator(&ms.it, prog, dfa, scratch, buffer, size, true, greedy);
+    for (size_t c = 0; c < ps.numChunks; c++) {
+        struct SearchChunk *chunk = &ps.chunks[c];
+        size_t first = 0;
+
+        if (ms.origin > chunk->start) {
+            // The previous match crossed into this chunk: rescan until back in step
+            first = rescanChunk(&ms, chunk, buffer, out);
+        }
+        bool inStep = first < chunk->numMatches || ms.origin <= chunk->start;
+
+        for (size_t i = first; i < chunk->numMatches; i++) {
+            struct Match *m = &chunk->matches[i];
+            printMatch(out, buffer + m->start, m);
+        }
+        if (first < chunk->numMatches) {
+            const struct Match *last = &chunk->matches[chunk->numMatches - 1];
+            mergeSkipTo(&ms, last->start + last->length);
+        }
+        if (inStep && !chunk->complete) {
+            // Take over where the worker gave up
+            mergeSkipTo(&ms, chunk->resume);
+            rescanChunk(&ms, chunk, buffer, out);
+        }
+        free(chunk->matches);
+    }
+    free(ps.chunks);
+}
+
+/*
+    Searching files
+
+    searchFile searches one open file, mapping it if it is a regular file and
+    streaming it otherwise. With several files, or with -r, searchPaths hands the
+    files and directories to a pool of workers, which share the program but have a
+    DFA and scratch space each. Every file's output is captured and printed as a
+    whole, in the order the paths were given and, within a directory, in order of
+    name, whichever worker finished first.
+*/
+
+struct SearchConfig {
+    const struct Program *prog;
+    bool greedy;
+    int numThreads;         // Per file, for a regular file
+    size_t dfaCacheStates;
+    bool skipBinary;        // Skip files with a NUL byte in their first block
+    const struct TrigramIndex *index;   // Of the file, with the query for the program, or NULL
+    const struct IndexQuery *query;
+};
+
+enum SearchStatus {
+    SEARCH_DONE,
+    SEARCH_BINARY,
+    SEARCH_OPEN_FAILED,
+    SEARCH_READ_FAILED,
+    SEARCH_IS_DIRECTORY,
+    SEARCH_CORRUPT,             // Compressed data that is not valid
+    SEARCH_NO_DECOMPRESSOR      // Compressed in a format this build cannot read
+};
+
+// Searches the parts of a mapped file the index cannot rule out
+static void searchIndexed(const struct SearchConfig *config, struct DFA *dfa, struct NFAScratch *scratch,
+                          const char *buffer, size_t size, struct Output *out) {
+    struct IndexRange *ranges;
+    size_t numRanges = indexCandidates(config->index, config->query, size, &ranges);
+    for (size_t i = 0; i < numRanges && !outputDone(out); i++) {
+        struct MatchIterator it;
+        initMatchIterator(&it, config->prog, dfa, scratch, buffer, ranges[i].end, true, config->greedy);
+        it.offset = ranges[i].start;
+        if (out->lineMode) {
+            // The lines in between are counted by the index rather than read
+            out->lineNumber += ranges[i].skippedLines;
+            out->nextLine = ranges[i].start;
+            printLines(&it, out);
+        } else {
+            printMatches(&it, out);
+        }
+    }
+    free(ranges);
+}
+
+// Searches what compressed input decompresses to, as a stream
+static enum SearchStatus searchCompressed(enum Compression compression, const struct SearchConfig *config,
+                                          struct DFA *dfa, struct NFAScratch *scratch, const char *mapped,
+                                          size_t mappedSize, struct StreamSource *source, struct Output *out) {
+    if (!canDecompress(compression)) {
+        return config->skipBinary ? SEARCH_BINARY : SEARCH_NO_DECOMPRESSOR;
+    }
+    if (config->index) {
+        fprintf(stderr, "Warning: The index is not used for compressed input, searching all of it\n");
+    }
+
+    struct StreamSource decompressed = { .decompressor = startDecompressor(compression, mapped, mappedSize, source) };
+    if (config->skipBinary && decompressedBinary(decompressed.decompressor)) {
+        stopDecompressor(decompressed.decompressor);
+        return SEARCH_BINARY;
+    }
+    struct MatchIterator it;
+    initMatchIterator(&it, config->prog, dfa, scratch, NULL, 0, false, config->greedy);
+    bool read = searchStream(&decompressed, &it, out);
+    bool valid = stopDecompressor(decompressed.decompressor);
+    return !valid ? SEARCH_CORRUPT : !read ? SEARCH_READ_FAILED : SEARCH_DONE;
+}
+
+static enum SearchStatus searchFile(int fd, const struct SearchConfig *config, struct DFA *dfa,
+                                    struct NFAScratch *scratch, struct Output *out) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return SEARCH_OPEN_FAILED;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        return SEARCH_IS_DIRECTORY;
+    }
+
+    // Regular files are mapped rather than read into memory
+    char *mapped = NULL;
+    size_t mappedSize = 0;
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        mappedSize = (size_t)st.st_size;
+        mapped = mmap(NULL, mappedSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            mapped = NULL;
+        } else {
+            madvise(mapped, mappedSize, MADV_SEQUENTIAL);
+        }
+    }
+
+    // Compressed input is recognized by its first bytes, which are read ahead of
+    // the rest from anything that is not mapped
+    struct StreamSource source = { .fd = fd };
+    if (!mapped && !isatty(fd) && !readHead(&source)) {
+        return SEARCH_READ_FAILED;
+    }
+    enum Compression compression = mapped ? detectCompression((const unsigned char *)mapped, mappedSize)
+                                          : detectCompression(source.head, source.headLength);
+    if (compression != COMPRESSION_NONE) {
+        enum SearchStatus status = searchCompressed(compression, config, dfa, scratch, mapped, mappedSize, &source,
+                                                    out);
+        if (mapped) {
+            munmap(mapped, mappedSize);
+        }
+        return status;
+    }
+
+    if (mapped && config->skipBinary &&
+        memchr(mapped, '\0', mappedSize < BINARY_CHECK_SIZE ? mappedSize : BINARY_CHECK_SIZE)) {
+        munmap(mapped, mappedSize);
+        return SEARCH_BINARY;
+    }
+
+    STAT_ADD(inputBytes, mappedSize);
+    struct MatchIterator it;
+    enum SearchStatus status = SEARCH_DONE;
+    bool indexed = mapped && config->index && indexCovers(config->index->header, mapped, mappedSize);
+    if (mapped && config->index && !indexed) {
+        fprintf(stderr, "Warning: The index is not of this file or it has changed, searching all of it\n");
+    }
+    if (indexed) {
+        searchIndexed(config, dfa, scratch, mapped, mappedSize, out);
+    } else if (mapped && config->numThreads > 1) {
+        searchParallel(config->prog, dfa, scratch, mapped, mappedSize, config->greedy, config->dfaCacheStates,
+                       config->numThreads, out);
+    } else if (mapped) {
+        initMatchIterator(&it, config->prog, dfa, scratch, mapped, mappedSize, true, config->greedy);
+        if (out->lineMode) {
+            printLines(&it, out);
+        } else {
+            printMatches(&it, out);
+        }
+    } else {
+        initMatchIterator(&it, config->prog, dfa, scratch, NULL, 0, false, config->greedy);
+        if (!searchStream(&source, &it, out)) {
+            status = SEARCH_READ_FAILED;
+        }
+    }
+
+    if (mapped) {
+        munmap(mapped, mappedSize);
+    }
+    return status;
+}
+
+static void printSearchError(enum SearchStatus status, const char *filename) {
+    if (status == SEARCH_OPEN_FAILED) {
+        fprintf(stderr, "Error: Could not open file '%s'\n", filename);
+    } else if (status == SEARCH_READ_FAILED) {
+        fprintf(stderr, "Error: Could not read file '%s'\n", filename);
+    } else if (status == SEARCH_IS_DIRECTORY) {
+        fprintf(stderr, "Error: '%s' is a directory\n", filename);
+    } else if (status == SEARCH_CORRUPT) {
+        fprintf(stderr, "Error: Could not decompress '%s', the data is not valid\n", filename);
+    } else if (status == SEARCH_NO_DECOMPRESSOR) {
+        fprintf(stderr, "Error: '%s' is compressed in a format this build cannot read\n", filename);
+    }
+}
+
+/*
+    The paths form a tree, with a node for every path given and every entry found
+    in a directory. A worker takes a node, lists it if it is a directory, adding
+    its entries as children, or searches it otherwise, and marks it done. Nodes are
+    taken from the top of a stack, so the workers roughly follow the order the
+    output is printed in and little finished output has to wait. Meanwhile the
+    main thread walks the tree in order, waiting for each node to be done,
+    printing and freeing it.
+*/
+struct WalkNode {
+    char *path;
+    bool listed;                // A directory whose entries are the children
+    struct WalkNode **children;
+    size_t numChildren;
+    bool done;
+    enum SearchStatus status;
+    struct Output out;
+};
+
+struct Walk {
+    const struct SearchConfig *config;
+    const struct Output *options;   // Copied into every file's output
+    bool recursive;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;         // Signalled when a node is done or one is added
+    struct WalkNode **stack;
+    size_t stackSize;
+    size_t maxStack;
+    size_t unfinished;              // Nodes on the stack or being worked on
+};
+
+struct WalkWorker {
+    struct Walk *walk;
+    struct DFA *dfa;
+    struct NFAScratch *scratch;
+};
+
+static struct WalkNode *newWalkNode(char *path) {
+    struct WalkNode *node = calloc(1, sizeof(struct WalkNode));
+    node->path = path;
+    return node;
+}
+
+// Adds the nodes so that the first one is taken first. The lock must be held.
+static void pushWalkNodes(struct Walk *walk, struct WalkNode **nodes, size_t count) {
+    if (walk->stackSize + count > walk->maxStack) {
+        walk->maxStack = 2 * (walk->stackSize + count);
+        STAT_ADD(reallocs, 1);
+        walk->stack = realloc(walk->stack, walk->maxStack * sizeof(struct WalkNode *));
+    }
+    for (size_t i = count; i > 0; i--) {
+        walk->stack[walk->stackSize++] = nodes[i - 1];
+    }
+    walk->unfinished += count;
+}
+
+static int compareNodePaths(const void *a, const void *b) {
+    return strcmp((*(struct WalkNode *const *)a)->path, (*(struct WalkNode *const *)b)->path);
+}
+
+// Makes the files and directories in the directory node's children, sorted by
+// name. Symbolic links and special files are left out.
+static enum SearchStatus listDirectory(struct WalkNode *node) {
+    DIR *dir = opendir(node->path);
+    if (!dir) {
+        return SEARCH_OPEN_FAILED;
+    }
+    size_t pathLength = strlen(node->path);
+    bool slash = pathLength > 0 && node->path[pathLength - 1] == '/';
+    size_t maxChildren = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        char *path = malloc(pathLength + strlen(entry->d_name) + 2);
+        sprintf(path, slash ? "%s%s" : "%s/%s", node->path, entry->d_name);
+
+        unsigned char type = entry->d_type;
+        struct stat st;
+        if (type == DT_UNKNOWN && lstat(path, &st) == 0) {
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (type != DT_DIR && type != DT_REG) {
+            free(path);
+            continue;
+        }
+
+        if (node->numChildren == maxChildren) {
+            maxChildren = maxChildren == 0 ? 16 : maxChildren * 2;
+            STAT_ADD(reallocs, 1);
+            node->children = realloc(node->children, maxChildren * sizeof(struct WalkNode *));
+        }
+        node->children[node->numChildren++] = newWalkNode(path);
+    }
+    closedir(dir);
+    if (node->numChildren > 1) {
+        qsort(node->children, node->numChildren, sizeof(struct WalkNode *), compareNodePaths);
+    }
+    node->listed = true;
+    return SEARCH_DONE;
+}
+
+static void walkNode(struct WalkWorker *worker, struct WalkNode *node) {
+    struct Walk *walk = worker->walk;
+    int fd = strcmp(node->path, "-") == 0 ? STDIN_FILENO : open(node->path, O_RDONLY);
+    if (fd < 0) {
+        node->status = SEARCH_OPEN_FAILED;
+        return;
+    }
+
+    node->out = *walk->options;
+    node->out.capture = true;
+    node->out.buffer = NULL;
+    node->out.buffered = 0;
+    node->out.capacity = 0;
+    node->out.filename = node->path;
+    node->status = searchFile(fd, walk->config, worker->dfa, worker->scratch, &node->out);
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+    if (node->status == SEARCH_IS_DIRECTORY && walk->recursive) {
+        node->status = listDirectory(node);
+    }
+}
+
+static void *walkWorker(void *arg) {
+    struct WalkWorker *worker = arg;
+    struct Walk *walk = worker->walk;
+    pthread_mutex_lock(&walk->lock);
+    while (true) {
+        while (walk->stackSize == 0 && walk->unfinished > 0) {
+            pthread_cond_wait(&walk->changed, &walk->lock);
+        }
+        if (walk->stackSize == 0) {
+            break;
+        }
+        struct WalkNode *node = walk->stack[--walk->stackSize];
+        pthread_mutex_unlock(&walk->lock);
+
+        walkNode(worker, node);
+
+        pthread_mutex_lock(&walk->lock);
+        pushWalkNodes(walk, node->children, node->numChildren);
+        node->done = true;
+        walk->unfinished--;
+        pthread_cond_broadcast(&walk->changed);
+    }
+    pthread_mutex_unlock(&walk->lock);
+    STAT_FLUSH();
+    return NULL;
+}
+
+// Prints the node's output, or that of every file below it, and frees it. Adds
+// to the number of matches and of files with a match.
+static void printWalkNode(struct Walk *walk, struct WalkNode *node, int *matchCount, size_t *filesMatched,
+                          int *status) {
+    pthread_mutex_lock(&walk->lock);
+    while (!node->done) {
+        pthread_cond_wait(&walk->changed, &walk->lock);
+    }
+    pthread_mutex_unlock(&walk->lock);
+
+    const struct Output *out = &node->out;
+    if (node->listed) {
+        for (size_t i = 0; i < node->numChildren; i++) {
+            printWalkNode(walk, node->children[i], matchCount, filesMatched, status);
+        }
+    } else if (node->status == SEARCH_BINARY) {
+        // Skipped
+    } else if (node->status != SEARCH_DONE) {
+        fflush(stdout);
+        printSearchError(node->status, node->path);
+        *status = 1;
+    } else if (out->filesOnly) {
+        if (out->matchCount > 0) {
+            printf("%s\n", node->path);
+        }
+    } else if (out->countOnly) {
+        printf("%s:%d\n", node->path, out->matchCount);
+    } else if (out->lineMode || out->format != FORMAT_TEXT) {
+        fwrite(out->buffer, 1, out->buffered, stdout);
+    } else if (out->matchCount > 0) {
+        printf("File \"%s\":\n", node->path);
+        fwrite(out->buffer, 1, out->buffered, stdout);
+        printf("\n");
+    }
+    if (node->status == SEARCH_DONE) {
+        *matchCount += out->matchCount;
+        *filesMatched += out->matchCount > 0;
+    }
+
+    free(out->buffer);
+    free(node->children);
+    free(node->path);
+    free(node);
+}
+
+/*
+    Searches every path on numWorkers threads, directories only if recursive, and
+    prints the output grouped by file. The first worker uses dfa and scratch.
+    Returns the exit status.
+*/
+static int searchPaths(char **paths, size_t numPaths, bool recursive, int numWorkers,
+                       const struct SearchConfig *config, struct DFA *dfa, struct NFAScratch *scratch,
+                       struct Output *out) {
+    struct Walk walk = {
+        .config = config,
+        .options = out,
+        .recursive = recursive,
+        .stack = NULL,
+        .stackSize = 0,
+        .maxStack = 0,
+        .unfinished = 0
     };
+    pthread_mutex_init(&walk.lock, NULL);
+    pthread_cond_init(&walk.changed, NULL);
+    struct WalkNode **roots = malloc(numPaths * sizeof(struct WalkNode *));
+    for (size_t i = 0; i < numPaths; i++) {
+        roots[i] = newWalkNode(strdup(paths[i]));
+    }
+    pushWalkNodes(&walk, roots, numPaths);
+
+    struct WalkWorker *workers = malloc(numWorkers * sizeof(struct WalkWorker));
+    pthread_t *threads = malloc(numWorkers * sizeof(pthread_t));
+    for (int i = 0; i < numWorkers; i++) {
+        workers[i].walk = &walk;
+        workers[i].dfa = i == 0 ? dfa : config->dfaCacheStates > 0 ? newDFA(config->prog, config->dfaCacheStates)
+                                                                   : NULL;
+        workers[i].scratch = i == 0 ? scratch : newNFAScratch(config->prog);
+        pthread_create(&threads[i], NULL, walkWorker, &workers[i]);
+    }
+
+    int status = 0;
+    int matchCount = 0;
+    size_t filesMatched = 0;
+    for (size_t i = 0; i < numPaths; i++) {
+        printWalkNode(&walk, roots[i], &matchCount, &filesMatched, &status);
+    }
+
+    for (int i = 0; i < numWorkers; i++) {
+        pthread_join(threads[i], NULL);
+        if (i > 0) {
+            if (workers[i].dfa) {
+                freeDFA(workers[i].dfa);
+            }
+            freeNFAScratch(workers[i].scratch);
+        }
+    }
+    free(threads);
+    free(workers);
+    free(roots);
+    free(walk.stack);
+    pthread_mutex_destroy(&walk.lock);
+    pthread_cond_destroy(&walk.changed);
+
+    if (!out->lineMode && out->format == FORMAT_TEXT) {
+        if (matchCount == 0) {
+            printf("No matches found.\n");
+        } else {
+            printf("Total matches: %d in %zu file%s\n", matchCount, filesMatched, filesMatched == 1 ? "" : "s");
+        }
+    }
+    return status;
 }
 
-// --------------------------------------------------------------------------- // 
-// --------------------------------------------------------------------------- // 
+// Builds the index at indexPath for the file, or brings it up to date. Returns
+// the exit status.
+static int indexFile(const char *indexPath, const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Error: Could not open file '%s'\n", filename);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 1;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Error: Only a regular file can be indexed, not '%s'\n", filename);
+        close(fd);
+        return 1;
+    }
+    size_t size = (size_t)st.st_size;
+    char *data = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Error: Could not read file '%s'\n", filename);
+        return 1;
+    }
+    if (data) {
+        madvise(data, size, MADV_SEQUENTIAL);
+    }
+
+    struct IndexHeader header;
+    size_t indexed;
+    bool ok = buildIndex(indexPath, data, size, &header, &indexed);
+    if (data) {
+        munmap(data, size);
+    }
+    if (!ok) {
+        fprintf(stderr, "Error: Could not write the index '%s'\n", indexPath);
+        return 1;
+    }
+    printf("Indexed %zu bytes of \"%s\", %llu bytes in %u blocks in all\n", indexed, filename,
+           (unsigned long long)header.indexedLength, header.numBlocks);
+    return 0;
+}
+
+// Writes a matcher for the patterns, as matched without -g, to stdout as C source
+// (see emitMatcher). Returns the exit status.
+static int emitPatterns(const char *name, char **patterns, size_t numPatterns, bool caseless) {
+    bool identifier = (isalpha((unsigned char)name[0]) || name[0] == '_');
+    for (const char *c = name; *c; c++) {
+        identifier = identifier && (isalnum((unsigned char)*c) || *c == '_');
+    }
+    if (!identifier) {
+        fprintf(stderr, "Error: '%s' is not a C identifier\n", name);
+        return 1;
+    }
+
+    struct NFA *nfas = malloc(numPatterns * sizeof(struct NFA));
+    for (size_t p = 0; p < numPatterns; p++) {
+        nfas[p] = constructNFA(patterns[p], caseless);
+        if (nfas[p].error) {
+            fprintf(stderr, "Error: Invalid pattern '%s': %s\n", patterns[p], nfas[p].error);
+            return 1;
+        }
+    }
+    struct Program *prog = compileNFA(nfas, numPatterns, false);
+    for (size_t p = 0; p < numPatterns; p++) {
+        freeNFA(&nfas[p]);
+    }
+    free(nfas);
+
+    const char *error = NULL;
+    bool ok = emitMatcher(stdout, prog, patterns, name, &error);
+    freeProgram(prog);
+    if (!ok) {
+        fprintf(stderr, "Error: Could not generate a matcher: %s\n", error);
+        return 1;
+    }
+    return 0;
+}
+
+static void addPattern(char ***patterns, size_t *numPatterns, size_t *maxPatterns, const char *pattern,
+                       size_t length) {
+    if (*numPatterns == *maxPatterns) {
+        *maxPatterns = *maxPatterns == 0 ? 8 : *maxPatterns * 2;
+        *patterns = realloc(*patterns, *maxPatterns * sizeof(char *));
+    }
+    char *copy = malloc(length + 1);
+    memcpy(copy, pattern, length);
+    copy[length] = '\0';
+    (*patterns)[(*numPatterns)++] = copy;
+}
+
+// Adds a pattern for every line of the file, so that pattern numbers are line
+// numbers. An empty line is kept as an empty pattern, which as in grep matches
+// every line in line mode.
+static bool readPatterns(const char *path, char ***patterns, size_t *numPatterns, size_t *maxPatterns) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return false;
+    }
+    char *line = NULL;
+    size_t lineCapacity = 0;
+    ssize_t length;
+    while ((length = getline(&line, &lineCapacity, file)) >= 0) {
+        if (length > 0 && line[length - 1] == '\n') {
+            length--;
+        }
+        addPattern(patterns, numPatterns, maxPatterns, line, (size_t)length);
+    }
+    free(line);
+    bool ok = !ferror(file);
+    fclose(file);
+    return ok;
+}
 
 int main(int argc, char *argv[]) {
     bool greedy = false;
-    char *pattern = NULL;
+    int numThreads = 0;         // Chosen once the number of files is known
+    bool recursive = false;
+    bool caseless = false;
+    size_t dfaCacheStates = DFA_DEFAULT_CACHE_STATES;
+    char **patterns = NULL;
+    size_t numPatterns = 0;
+    size_t maxPatterns = 0;
     char *filename = NULL;
+    const char *cacheDir = NULL;
+    const char *indexPath = NULL;
+    const char *buildIndexPath = NULL;
+    const char *emitName = NULL;
+    bool stats = false;
+    struct Output out = {0};
     
     // Parse command line arguments
-    if (argc < 3 || argc > 4) {
-        fprintf(stderr, "Usage: %s [-g] <pattern> <filename>\n", argv[0]);
-        fprintf(stderr, "  -g: Enable greedy matching (find longest match)\n");
-        return 1;
+    int argIdx = 1;
+    while (argIdx < argc && argv[argIdx][0] == '-') {
+        if (strcmp(argv[argIdx], "-g") == 0) {
+            greedy = true;
+            argIdx++;
+        } else if (strcmp(argv[argIdx], "-n") == 0) {
+            out.lineNumbers = true;
+            argIdx++;
+        } else if (strcmp(argv[argIdx], "-c") == 0) {
+            out.countOnly = true;
+            argIdx++;
+        } else if (strcmp(argv[argIdx], "-l") == 0) {
+            out.filesOnly = true;
+            argIdx++;
+        } else if (strcmp(argv[argIdx], "-v") == 0) {
+            out.invert = true;
+            argIdx++;
+        } else if (strcmp(argv[argIdx], "-r") == 0) {
+            recursive = true;
+            argIdx++;
+        } else if (strcmp(argv[argIdx], "-i") == 0) {
+            caseless = true;
+            argIdx++;
+        } else if (strcmp(argv[argIdx], "-e") == 0 && argIdx + 1 < argc) {
+            addPattern(&patterns, &numPatterns, &maxPatterns, argv[argIdx + 1], strlen(argv[argIdx + 1]));
+            argIdx += 2;
+        } else if (strcmp(argv[argIdx], "-f") == 0 && argIdx + 1 < argc) {
+            if (!readPatterns(argv[argIdx + 1], &patterns, &numPatterns, &maxPatterns)) {
+                fprintf(stderr, "Error: Could not read patterns from '%s'\n", argv[argIdx + 1]);
+                return 1;
+            }
+            argIdx += 2;
+        } else if (strcmp(argv[argIdx], "-j") == 0 && argIdx + 1 < argc) {
+            numThreads = atoi(argv[argIdx + 1]);
+            if (numThreads < 1) {
+                printUsage(argv[0]);
+                return 1;
+            }
+            argIdx += 2;
+        } else if (strcmp(argv[argIdx], "--dfa-cache") == 0 && argIdx + 1 < argc) {
+            char *end;
+            dfaCacheStates = strtoul(argv[argIdx + 1], &end, 10);
+            if (*end) {
+                printUsage(argv[0]);
+                return 1;
+            }
+            argIdx += 2;
+        } else if (strcmp(argv[argIdx], "--cache") == 0 && argIdx + 1 < argc) {
+            cacheDir = argv[argIdx + 1];
+            argIdx += 2;
+        } else if (strcmp(argv[argIdx], "--index") == 0 && argIdx + 1 < argc) {
+            indexPath = argv[argIdx + 1];
+            argIdx += 2;
+        } else if (strcmp(argv[argIdx], "--build-index") == 0 && argIdx + 1 < argc) {
+            buildIndexPath = argv[argIdx + 1];
+            argIdx += 2;
+        } else if (strcmp(argv[argIdx], "--emit-c") == 0 && argIdx + 1 < argc) {
+            emitName = argv[argIdx + 1];
+            argIdx += 2;
+        } else if (strcmp(argv[argIdx], "--stats") == 0) {
+#ifndef PDA_STATS
+            fprintf(stderr, "Error: --stats needs pda built with -DPDA_STATS\n");
+            return 1;
+#endif
+            stats = true;
+            argIdx++;
+        } else if (strcmp(argv[argIdx], "--format") == 0 && argIdx + 1 < argc) {
+            const char *format = argv[argIdx + 1];
+            if (strcmp(format, "text") == 0) {
+                out.format = FORMAT_TEXT;
+            } else if (strcmp(format, "tsv") == 0) {
+                out.format = FORMAT_TSV;
+            } else if (strcmp(format, "binary") == 0) {
+                out.format = FORMAT_BINARY;
+            } else {
+                printUsage(argv[0]);
+                return 1;
+            }
+            argIdx += 2;
+        } else {
+            break;
+        }
     }
     
-    int argIdx = 1;
+    if (buildIndexPath) {
+        if (argc - argIdx != 1 || numPatterns > 0) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        return indexFile(buildIndexPath, argv[argIdx]);
+    }
     
-    // Check for -g flag
-    if (strcmp(argv[argIdx], "-g") == 0) {
-        greedy = true;
-        argIdx++;
+    if (emitName) {
+        if (numPatterns == 0 && argc - argIdx == 1) {
+            addPattern(&patterns, &numPatterns, &maxPatterns, argv[argIdx], strlen(argv[argIdx]));
+            argIdx++;
+        }
+        if (numPatterns == 0 || argIdx != argc) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        int status = emitPatterns(emitName, patterns, numPatterns, caseless);
+        for (size_t p = 0; p < numPatterns; p++) {
+            free(patterns[p]);
+        }
+        free(patterns);
+        return status;
     }
     
-    if (argc - argIdx != 2) {
-        fprintf(stderr, "Usage: %s [-g] <pattern> <filename>\n", argv[0]);
-        fprintf(stderr, "  -g: Enable greedy matching (find longest match)\n");
+    // Without -e or -f the pattern comes before the filename
+    if (numPatterns == 0 && argc - argIdx >= 2) {
+        addPattern(&patterns, &numPatterns, &maxPatterns, argv[argIdx], strlen(argv[argIdx]));
+        argIdx++;
+    }
+    if (numPatterns == 0 || argc - argIdx < 1) {
+        printUsage(argv[0]);
         return 1;
     }
     
-    pattern = argv[argIdx];
-    filename = argv[argIdx + 1];
+    // Several files, or the files under a directory, are searched on a pool of
+    // threads, by default one per processor
+    filename = argv[argIdx];
+    size_t numPaths = (size_t)(argc - argIdx);
+    bool manyFiles = recursive || numPaths > 1;
+    if (manyFiles && numThreads == 0) {
+        long processors = sysconf(_SC_NPROCESSORS_ONLN);
+        numThreads = processors > 0 ? (int)processors : 1;
+    } else if (numThreads == 0) {
+        numThreads = 1;
+    }
     
-    // Open and read file
-    FILE *file = fopen(filename, "r");
-    if (!file) {
-        fprintf(stderr, "Error: Could not open file '%s'\n", filename);
+    // Line mode reports whole lines, so how far a match extends does not matter
+    out.lineMode = out.lineNumbers || out.countOnly || out.filesOnly || out.invert;
+    out.lineNumber = 1;
+    out.showPattern = numPatterns > 1 && !out.lineMode;
+    if (out.lineMode) {
+        greedy = false;
+    }
+    if (out.lineMode && out.format != FORMAT_TEXT) {
+        fprintf(stderr, "Error: --format only applies to matches, not to -n, -c, -l or -v\n");
         return 1;
     }
-    
-    // Get file size
-    fseek(file, 0, SEEK_END);
-    long fileSize = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    
-    // Read entire file into string
-    char *contents = malloc(fileSize + 1);
-    if (!contents) {
-        fprintf(stderr, "Error: Could not allocate memory\n");
-        fclose(file);
+    if (manyFiles && out.format == FORMAT_BINARY) {
+        fprintf(stderr, "Error: --format binary only applies to a single file\n");
         return 1;
     }
-    
-    size_t bytesRead = fread(contents, 1, fileSize, file);
-    contents[bytesRead] = '\0';
-    fclose(file);
-
-    if (bytesRead != (size_t)fileSize) {
-        fprintf(stderr, "Warning: Expected to read %ld bytes, but read %zu bytes\n", fileSize, bytesRead);
+    if (manyFiles && indexPath) {
+        fprintf(stderr, "Error: --index only applies to a single file\n");
+        return 1;
     }
+    out.buffer = malloc(OUTPUT_BUFFER_SIZE);
     
-    // Construct NFA from pattern
-    struct NFA nfa = constructNFA(pattern);
+    // Open a single file up front, so that nothing is compiled if it is missing
+    int fd = -1;
+    if (!manyFiles) {
+        fd = strcmp(filename, "-") == 0 ? STDIN_FILENO : open(filename, O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "Error: Could not open file '%s'\n", filename);
+            return 1;
+        }
+    }
     
-    printf("Searching for pattern \"%s\" in file \"%s\" (%s):\n\n", 
-           pattern, filename, greedy ? "greedy" : "non-greedy");
+    // Load the program from the cache, or construct NFAs from the patterns and
+    // combine them into one program
+    unsigned options = (out.lineMode ? PDA_LINES : 0) | (caseless ? PDA_CASELESS : 0);
+    STAT_TIME_BEGIN(compileNanos);
+    char *cachePath = NULL;
+    struct Program *prog = NULL;
+    if (cacheDir) {
+        cachePath = malloc(strlen(cacheDir) + 32);
+        sprintf(cachePath, "%s/%016llx.pdac", cacheDir,
+                (unsigned long long)programKey(patterns, numPatterns, options));
+        prog = loadProgram(cachePath, patterns, numPatterns, options);
+        STAT_ADD(cacheHits, prog != NULL);
+        STAT_ADD(cacheMisses, prog == NULL);
+    }
+    uint32_t cachedDfaStates = prog ? prog->numDfaStates : 0;
+    bool cached = prog != NULL;
+    if (!prog) {
+        struct NFA *nfas = malloc(numPatterns * sizeof(struct NFA));
+        for (size_t p = 0; p < numPatterns; p++) {
+            nfas[p] = constructNFA(patterns[p], caseless);
+            if (nfas[p].error) {
+                fprintf(stderr, "Error: Invalid pattern '%s': %s\n", patterns[p], nfas[p].error);
+                return 1;
+            }
+            STAT_ADD(nfaStates, nfas[p].numStates);
+        }
+        prog = compileNFA(nfas, numPatterns, out.lineMode);
+        for (size_t p = 0; p < numPatterns; p++) {
+            freeNFA(&nfas[p]);
+        }
+        free(nfas);
+    }
+    STAT_TIME_END(compileNanos);
+    if (prog->literals) {
+        dfaCacheStates = 0;     // The literal automaton is already a DFA
+    }
+    struct DFA *dfa = NULL;
+    if (dfaCacheStates > 0) {
+        dfa = newDFA(prog, dfaCacheStates);
+    }
+    struct NFAScratch *scratch = newNFAScratch(prog);
     
-    // Find all occurrences
-    size_t offset = 0;
-    int matchCount = 0;
+    // Lines without a match are wanted from every block with -v, so the index
+    // cannot narrow that search down
+    struct TrigramIndex *index = NULL;
+    struct IndexQuery *query = NULL;
+    if (indexPath && !out.invert) {
+        index = loadIndex(indexPath);
+        query = index ? planIndexQuery(prog) : NULL;
+        if (!index) {
+            fprintf(stderr, "Warning: Could not read the index '%s', searching all of the file\n", indexPath);
+        } else if (!query) {
+            fprintf(stderr, "Warning: The index cannot be used for this pattern, searching all of the file\n");
+        }
+    }
     
-    while (offset < strlen(contents)) {
-        int matchLen = 0;
-        int result = runNFA(&nfa.states[0], contents + offset, true, greedy, &matchLen);
-        
-        if (result == -1) {
-            break;  // No more matches found
+    // Line mode output is just the lines, count or filename, as from grep, and the
+    // machine-readable formats are just the matches
+    bool text = !out.lineMode && out.format == FORMAT_TEXT;
+    if (text) {
+        if (numPatterns == 1) {
+            printf("Searching for pattern \"%s\" in ", patterns[0]);
+        } else {
+            printf("Searching for %zu patterns in ", numPatterns);
         }
-        
-        size_t matchIndex = offset + result;
-        
-        // Skip empty matches - require at least one character
-        if (matchLen == 0) {
-            offset++;
-            continue;
+        if (manyFiles) {
+            printf("%zu %s%s", numPaths, recursive ? "path" : "file", numPaths == 1 ? "" : "s");
+        } else {
+            printf("file \"%s\"", filename);
+        }
+        printf(" (%s):\n\n", greedy ? "greedy" : "non-greedy");
+    }
+    
+    // Find all occurrences
+    struct SearchConfig config = {
+        .prog = prog,
+        .greedy = greedy,
+        .numThreads = manyFiles ? 1 : numThreads,
+        .dfaCacheStates = dfaCacheStates,
+        .skipBinary = manyFiles,
+        .index = query ? index : NULL,
+        .query = query
+    };
+    int status = 0;
+    STAT_TIME_BEGIN(searchNanos);
+    if (manyFiles) {
+        fflush(stdout);
+        status = searchPaths(argv + argIdx, numPaths, recursive, numThreads, &config, dfa, scratch, &out);
+    } else {
+        enum SearchStatus result = searchFile(fd, &config, dfa, scratch, &out);
+        if (result != SEARCH_DONE) {
+            flushOutput(&out);
+            fflush(stdout);
+            printSearchError(result, filename);
+            status = 1;
         }
-        
-        // Extract and print the matched string
-        char *matchedStr = malloc(matchLen + 1);
-        strncpy(matchedStr, contents + matchIndex, matchLen);
-        matchedStr[matchLen] = '\0';
-        
-        printf("Match #%d at index %zu: \"%s\"\n", ++matchCount, matchIndex, matchedStr);
-        free(matchedStr);
-        
-        // Advance past the matched string (non-overlapping matches)
-        offset = matchIndex + matchLen;
     }
+    STAT_TIME_END(searchNanos);
     
-    if (matchCount == 0) {
+    flushOutput(&out);
+    if (manyFiles) {
+        // Each file's output has been printed by searchPaths
+    } else if (out.filesOnly) {
+        if (out.matchCount > 0) {
+            printf("%s\n", filename);
+        }
+    } else if (out.countOnly) {
+        printf("%d\n", out.matchCount);
+    } else if (!text) {
+        // The lines or records have been printed
+    } else if (out.matchCount == 0) {
         printf("No matches found.\n");
     } else {
-        printf("\nTotal matches: %d\n", matchCount);
+        printf("\nTotal matches: %d\n", out.matchCount);
     }
     
-    // Cleanup
-    for (size_t i = 0; i < nfa.numStates; i++) {
-        for (size_t tr = 0; tr < nfa.states[i].numTransitions; tr++) {
-            free(nfa.states[i].transitions[tr].transitionChars);
+    // Save the program, or the DFA states since built, for the next run
+    if (cachePath && (!cached || (dfa && dfa->numStates > cachedDfaStates))) {
+        mkdir(cacheDir, 0777);
+        if (!saveProgram(cachePath, prog, dfa, patterns, numPatterns, options)) {
+            fprintf(stderr, "Warning: Could not write the pattern cache in '%s'\n", cacheDir);
         }
-        free(nfa.states[i].transitions);
     }
-    free(nfa.states);
-    free(contents);
+    free(cachePath);
     
-    return 0;
-}
\ No newline at end of file
+    if (stats) {
+        STAT_FLUSH();
+        STAT_REPORT(prog);
+    }
+    
+    // Cleanup
+    if (index) {
+        freeIndex(index);
+    }
+    if (query) {
+        freeIndexQuery(query);
+    }
+    if (dfa) {
+        freeDFA(dfa);
+    }
+    freeNFAScratch(scratch);
+    freeProgram(prog);
+    for (size_t p = 0; p < numPatterns; p++) {
+        free(patterns[p]);
+    }
+    free(patterns);
+    free(out.buffer);
+    if (fd >= 0 && fd != STDIN_FILENO) {
+        close(fd);
+    }
+    
+    return status;
+}
+
+#endif // PDA_NO_MAIN
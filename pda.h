@@ -0,0 +1,59 @@
+/*
+    pda library interface
+
+    The matcher in pda.c can be built as a library, leaving out the command line
+    tool:
+
+        cc -O2 -fPIC -fvisibility=hidden -DPDA_NO_MAIN -c pda.c -o pda.o
+        ar rcs libpda.a pda.o
+        cc -shared -pthread -o libpda.so pda.o
+
+    Patterns are compiled once into an immutable PDARegex, which any number of
+    threads can search with at once. Each thread needs a PDAScratch of its own,
+    holding its working memory and DFA cache. Buffers are searched by length, so
+    they may hold NUL bytes and need not be terminated.
+*/
+
+#ifndef PDA_H
+#define PDA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __GNUC__
+#define PDA_API __attribute__((visibility("default")))
+#else
+#define PDA_API
+#endif
+
+// Flags for pdaCompile
+#define PDA_GREEDY 1    // Report the longest match from where the earliest match starts
+#define PDA_LINES 2     // Wildcards do not match a newline, so matches stay within a line
+#define PDA_CASELESS 4  // Letters match in either case
+
+struct PDARegex;
+struct PDAScratch;
+
+struct PDAMatch {
+    size_t start;
+    size_t length;
+    uint32_t pattern;   // Index of the lowest-numbered pattern matching this span
+};
+
+// Compiles the patterns into one regex matching any of them. Returns NULL if a
+// pattern is invalid, setting *error (if error is not NULL) to say why.
+PDA_API struct PDARegex *pdaCompile(const char *const *patterns, size_t numPatterns, unsigned flags,
+                                    const char **error);
+PDA_API void pdaFree(struct PDARegex *regex);
+
+PDA_API struct PDAScratch *pdaNewScratch(const struct PDARegex *regex);
+PDA_API void pdaFreeScratch(struct PDAScratch *scratch);
+
+// Finds the first non-empty match in buffer[from, length). Passing the end of
+// each match as the next from reports every match in turn. The scratch must
+// have been made for the same regex.
+PDA_API bool pdaSearch(const struct PDARegex *regex, struct PDAScratch *scratch, const char *buffer, size_t length,
+                       size_t from, struct PDAMatch *match);
+
+#endif // PDA_H